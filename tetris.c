@@ -1,5 +1,15 @@
 /*
- * Compilation: gcc -o tetris tetris.c
+ * Compilation: gcc -o tetris tetris.c -pthread -lz
+ * Library:     gcc -O2 -shared -fPIC -fvisibility=hidden -DTETRIS_LIBRARY -o libtetris.so tetris.c -pthread
+ * Tracing:     add -DTETRIS_TRACE, then ./tetris --trace FILE dumps a Chrome trace on quit
+ *
+ * Usage: ./tetris [--das P:DAS_MS:ARR_MS]... [--trace FILE]  2p battle in the terminal
+ *        ./tetris --dataset DIR [RECORDS] [THREADS]  headless self-play training data
+ *        ./tetris --bench-env [SEAT_STEPS]           libtetris batch-step throughput
+ *        ./tetris --bench-render                     bytes per line clear, scroll margins vs full repaint
+ *        ./tetris --test-das                         replays key-stream taps and holds, checks the columns moved
+ *        ./tetris --server [PORT] [SHARDS] [GRAVITY_MS]  sharded 2p match server
+ *        ./tetris --loadgen [HOST] [PORT] [CLIENTS] [SECONDS] [ACTIONS_PER_S]  bot clients for --server
  */
 
 #include <stdio.h>
@@ -8,6 +18,29 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#ifndef TETRIS_LIBRARY
+#include <zlib.h> // dataset shards only, libtetris does not link zlib
+#endif
+#include "tetris.h"
 #include <time.h> // ұĢ    time Լ
 
 #define ESC 27
@@ -54,11 +87,31 @@
 #define PLAYFIELD_EMPTY_CELL " ."
 
 struct termios terminal_conf;
-int use_color = 1;
+int use_color = 1; // owned by the render thread
 long tetris_delay = DELAY * 1000000;
 int attack1 = 0;
 int attack2 = 0;
 
+static int square_data[] = { 1, 0x1256 };
+static int line_data[] = { 2, 0x159d, 0x4567 };
+static int s_data[] = { 2, 0x4512, 0x0459 };
+static int z_data[] = { 2, 0x0156, 0x1548 };
+static int l_data[] = { 4, 0x159a, 0x8456, 0x0159, 0x2654 };
+static int r_data[] = { 4, 0x1598, 0x0456, 0x2159, 0xa654 };
+static int t_data[] = { 4, 0x1456, 0x1596, 0x4569, 0x4159 };
+static int *piece_data[] = {
+    square_data,
+    line_data,
+    s_data,
+    z_data,
+    l_data,
+    r_data,
+    t_data
+};
+static int piece_data_len = sizeof(piece_data) / sizeof(piece_data[0]);
+static int piece_colors[] = { RED, GREEN, YELLOW, BLUE, FUCHSIA, CYAN, WHITE };
+static int piece_colors_len = sizeof(piece_colors) / sizeof(piece_colors[0]);
+
 typedef struct {
     int origin_x;
     int origin_y;
@@ -107,19 +160,141 @@ void set_bold() {
     printf("\033[1m");
 }
 
+/*
+ * Tracing.
+ *
+ * Built with -DTETRIS_TRACE, ./tetris --trace FILE records begin/end events
+ * for input, movement, locking, garbage and rendering, and cmd_quit writes
+ * them to FILE as Chrome trace-event JSON (ui.perfetto.dev, chrome://tracing).
+ * Each thread appends to its own ring and the rings are only read after the
+ * render thread is joined, so recording takes no locks. A full ring
+ * overwrites its oldest events. When the build has tracing but --trace is
+ * not given, each probe costs one predictable branch.
+ */
+
+#ifdef TETRIS_TRACE
+#define TRACE_RING_SIZE 65536 // events per thread, power of two
+
+typedef struct {
+    const char *name;
+    long ts; // ns, CLOCK_MONOTONIC
+    char phase; // 'B' or 'E'
+} trace_event_s;
+
+typedef struct trace_ring {
+    trace_event_s events[TRACE_RING_SIZE];
+    size_t count;
+    const char *thread_name;
+    int tid;
+    struct trace_ring *next;
+} trace_ring_s;
+
+static int trace_enabled = 0;
+static const char *trace_path = NULL;
+static long trace_epoch = 0;
+static _Atomic(trace_ring_s *) trace_rings; // every thread's ring
+static atomic_int trace_tids;
+static __thread trace_ring_s *trace_ring;
+
+static long trace_now() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static trace_ring_s *trace_ring_get() { // first use in a thread allocates its ring and pushes it on the list
+    if (!trace_ring) {
+        trace_ring = calloc(1, sizeof(trace_ring_s));
+        trace_ring->tid = atomic_fetch_add(&trace_tids, 1) + 1;
+        trace_ring->next = atomic_load(&trace_rings);
+        while (!atomic_compare_exchange_weak(&trace_rings, &trace_ring->next, trace_ring)) {
+        }
+    }
+    return trace_ring;
+}
+
+void trace_event(const char *name, char phase) {
+    trace_ring_s *ring = trace_ring_get();
+    trace_event_s *event = &ring->events[ring->count++ & (TRACE_RING_SIZE - 1)];
+
+    event->name = name;
+    event->ts = trace_now();
+    event->phase = phase;
+}
+
+void trace_start(const char *path) {
+    trace_path = path;
+    trace_epoch = trace_now();
+    trace_enabled = 1;
+}
+
+void trace_dump() { // call once the other threads are joined
+    trace_ring_s *ring = NULL;
+    trace_event_s *event = NULL;
+    FILE *out = NULL;
+    size_t i = 0;
+    long written = 0;
+    int depth = 0;
+
+    if (!trace_enabled || !(out = fopen(trace_path, "w"))) {
+        if (trace_enabled) {
+            perror(trace_path);
+        }
+        return;
+    }
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (ring = atomic_load(&trace_rings); ring; ring = ring->next) {
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                written++ ? ",\n" : "", getpid(), ring->tid, ring->thread_name ? ring->thread_name : "thread");
+        depth = 0;
+        for (i = ring->count > TRACE_RING_SIZE ? ring->count - TRACE_RING_SIZE : 0; i < ring->count; i++) {
+            event = &ring->events[i & (TRACE_RING_SIZE - 1)];
+            if (event->phase == 'E' && depth == 0) { // its begin was overwritten
+                continue;
+            }
+            depth += (event->phase == 'B') ? 1 : -1;
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                    event->name, event->phase, (event->ts - trace_epoch) / 1000.0, getpid(), ring->tid);
+            written++;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    fprintf(stderr, "%ld trace events written to %s\n", written, trace_path);
+}
+
+#define TRACE_BEGIN(name) do { if (__builtin_expect(trace_enabled, 0)) trace_event(name, 'B'); } while (0)
+#define TRACE_END(name) do { if (__builtin_expect(trace_enabled, 0)) trace_event(name, 'E'); } while (0)
+#define TRACE_THREAD(name) do { if (trace_enabled) trace_ring_get()->thread_name = (name); } while (0)
+#define TRACE_DUMP() trace_dump()
+#define TRACE_USAGE " [--trace FILE]"
+#else
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+#define TRACE_THREAD(name)
+#define TRACE_DUMP()
+#define TRACE_USAGE ""
+#endif
+
+void render_stop();
+int input_stop(int y);
+
 void cmd_quit() {
-    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+    int rows = 0;
 
-    fcntl(STDOUT_FILENO, F_SETFL, flags & (~O_NONBLOCK));
+    render_stop();
     xyprint(GAMEOVER_X, GAMEOVER_Y, "Game over!");
-    xyprint(GAMEOVER_X, GAMEOVER_Y + 1, "");
+    rows = input_stop(GAMEOVER_Y + 1);
+    xyprint(GAMEOVER_X, GAMEOVER_Y + 1 + rows, "");
     show_cursor();
     tcsetattr(STDIN_FILENO, TCSANOW, &terminal_conf);
+    TRACE_DUMP();
     exit(0);
 }
 
 int *get_cells(tetris_piece_s piece, int *position) {
-    static int cells[8] = {};
+    static __thread int cells[8] = {};
     int i = 0;
     int data = *(piece.data + piece.orientation);
     int x = piece.x;
@@ -143,6 +318,7 @@ void draw_piece(tetris_piece_s piece, int visible) {
     int x = 0;
     int y = 0;
 
+    TRACE_BEGIN("draw_piece");
     if (visible) {
         set_fg(piece.color);
         set_bg(piece.color);
@@ -155,6 +331,7 @@ void draw_piece(tetris_piece_s piece, int visible) {
     if (visible) {
         reset_colors();
     }
+    TRACE_END("draw_piece");
 }
 
 int position_ok(tetris_piece_s piece, int *playfield, int *position) {
@@ -175,16 +352,17 @@ int position_ok(tetris_piece_s piece, int *playfield, int *position) {
 
 int move(tetris_piece_s *piece, int *playfield, int dx, int dy, int dz) {
     int new_position[] = {piece->x + dx, piece->y + dy, (piece->orientation + dz) % piece->symmetry};
+    int moved = (dy == 0);
 
+    TRACE_BEGIN("move");
     if (position_ok(*piece, playfield, new_position)) {
-        draw_piece(*piece, 0);
         piece->x = new_position[0];
         piece->y = new_position[1];
         piece->orientation = new_position[2];
-        draw_piece(*piece, 1);
-        return 1;
+        moved = 1;
     }
-    return (dy == 0);
+    TRACE_END("move");
+    return moved;
 }
 
 void flatten_piece(tetris_piece_s *piece, int *playfield) {
@@ -200,51 +378,61 @@ void flatten_piece(tetris_piece_s *piece, int *playfield) {
     }
 }
 
-void draw_playfield(int *playfield) {
+void draw_playfield_row(int origin_x, int y, int line) {
     int x = 0;
-    int y = 0;
     int color = 0;
 
-    for (y = 0; y < PLAYFIELD_H; y++) {
-        xyprint(PLAYFIELD_X, PLAYFIELD_Y + y, "");
-        for (x = 0; x < PLAYFIELD_W; x++) {
-            color = (*(playfield + y) >> (x * 3)) & 7;
-            if (color) {
-                set_bg(color);
-                set_fg(color);
-                printf(FILLED_CELL);
-                reset_colors();
-            } else {
-                printf(PLAYFIELD_EMPTY_CELL);
-            }
+    xyprint(origin_x, y, "");
+    for (x = 0; x < PLAYFIELD_W; x++) {
+        color = (line >> (x * 3)) & 7;
+        if (color) {
+            set_bg(color);
+            set_fg(color);
+            printf(FILLED_CELL);
+            reset_colors();
+        } else {
+            printf(PLAYFIELD_EMPTY_CELL);
         }
     }
 }
 
+void draw_playfield(int *playfield) {
+    int y = 0;
+
+    TRACE_BEGIN("draw_playfield");
+    for (y = 0; y < PLAYFIELD_H; y++) {
+        draw_playfield_row(PLAYFIELD_X, PLAYFIELD_Y + y, *(playfield + y));
+    }
+    TRACE_END("draw_playfield");
+}
+
 void draw_playfield1(int *playfield) { // playfield εϿ 2p ȭ  
-	int x = 0;
 	int y = 0;
-	int color = 0;
 
+	TRACE_BEGIN("draw_playfield");
 	for (y = 0; y < PLAYFIELD_H; y++) {
-		xyprint(PLAYFIELD_XX, PLAYFIELD_Y + y, "");
-		for (x = 0; x < PLAYFIELD_W; x++) {
-			color = (*(playfield + y) >> (x * 3)) & 7;
-			if (color) {
-				set_bg(color);
-				set_fg(color);
-				printf(FILLED_CELL);
-				reset_colors();
-			}
-			else {
-				printf(PLAYFIELD_EMPTY_CELL);
-			}
-		}
+		draw_playfield_row(PLAYFIELD_XX, PLAYFIELD_Y + y, *(playfield + y));
 	}
+	TRACE_END("draw_playfield");
 }
 
  
 
+void push_garbage_line(int *playfield, int hole) { // shift the stack up and add a garbage line with one hole
+    int i = 0;
+
+    TRACE_BEGIN("garbage");
+    for (i = 0; i < PLAYFIELD_H - 1; i++) {
+        *(playfield + i) = *(playfield + i + 1);
+    }
+    *(playfield + PLAYFIELD_H - 1) = 7;
+    for (i = 0; i < PLAYFIELD_W - 1; i++) {
+        *(playfield + PLAYFIELD_H - 1) = (*(playfield + PLAYFIELD_H - 1) << 3) + 7;
+    }
+    *(playfield + PLAYFIELD_H - 1) ^= (7 << 3 * hole);
+    TRACE_END("garbage");
+}
+
 int line_complete(int line) {
     int i = 0;
 
@@ -301,26 +489,28 @@ void process_fallen_piece(tetris_piece_s *piece, int *playfield, int *playfield1
 	int i;
 	srand(time(NULL));
 
+    TRACE_BEGIN("process_fallen_piece");
     flatten_piece(piece, playfield);
     complete_lines = process_complete_lines(playfield);
     if (complete_lines > 0) {
 		attack1 = complete_lines;//
         /*update_score(complete_lines);*/
-        draw_playfield(playfield);
     }
+    TRACE_END("process_fallen_piece");
 }
 
 void process_fallen_piece1(tetris_piece_s *piece, int *playfield, int *playfield1) { // 2p blcok Ͻ ׼
 	int complete_lines = 0;
 	int i;
 
+	TRACE_BEGIN("process_fallen_piece");
 	flatten_piece(piece, playfield);
 	complete_lines = process_complete_lines(playfield); // ȯ  
 	if (complete_lines > 0) {
 		attack2 = complete_lines;// ȯ    īƮ 
 		/*update_score(complete_lines);*/
-		draw_playfield1(playfield);//  player ȭ 
 	}
+	TRACE_END("process_fallen_piece");
 }
 
 void cmd_right(tetris_piece_s *piece, int *playfield) {
@@ -460,25 +650,7 @@ void draw_border1() { // 2p 
 	reset_colors();
 }
 
-tetris_piece_s get_next_piece(int visible) {
-    static int square_data[] = { 1, 0x1256 };
-    static int line_data[] = { 2, 0x159d, 0x4567 };
-    static int s_data[] = { 2, 0x4512, 0x0459 };
-    static int z_data[] = { 2, 0x0156, 0x1548 };
-    static int l_data[] = { 4, 0x159a, 0x8456, 0x0159, 0x2654 };
-    static int r_data[] = { 4, 0x1598, 0x0456, 0x2159, 0xa654 };
-    static int t_data[] = { 4, 0x1456, 0x1596, 0x4569, 0x4159 };
-    static int *piece_data[] = {
-        square_data,
-        line_data,
-        s_data,
-        z_data,
-        l_data,
-        r_data,
-        t_data
-    };
-    static int piece_data_len = sizeof(piece_data) / sizeof(piece_data[0]);
-    static int colors[] = { RED, GREEN, YELLOW, BLUE, FUCHSIA, CYAN, WHITE};
+tetris_piece_s get_next_piece() {
     int next_piece_index = random() % piece_data_len;
     int *next_piece_data = piece_data[next_piece_index];
     tetris_piece_s next_piece;
@@ -487,34 +659,15 @@ tetris_piece_s get_next_piece(int visible) {
     next_piece.origin_y = NEXT_Y;
     next_piece.x = 0;
     next_piece.y = 0;
-    next_piece.color = colors[random() % (sizeof(colors) / sizeof(colors[0]))];
+    next_piece.color = piece_colors[random() % piece_colors_len];
     next_piece.data = next_piece_data + 1;
     next_piece.symmetry = *next_piece_data;
     next_piece.orientation = random() % next_piece.symmetry;
     strcpy(next_piece.empty_cell, NEXT_EMPTY_CELL);
-    draw_piece(next_piece, visible);
     return next_piece;
 }
 
-tetris_piece_s get_next_piece1(int visible) { // 2p ÷̾  next piece
-	static int square_data[] = { 1, 0x1256 };
-	static int line_data[] = { 2, 0x159d, 0x4567 };
-	static int s_data[] = { 2, 0x4512, 0x0459 };
-	static int z_data[] = { 2, 0x0156, 0x1548 };
-	static int l_data[] = { 4, 0x159a, 0x8456, 0x0159, 0x2654 };
-	static int r_data[] = { 4, 0x1598, 0x0456, 0x2159, 0xa654 };
-	static int t_data[] = { 4, 0x1456, 0x1596, 0x4569, 0x4159 };
-	static int *piece_data[] = {
-		square_data,
-		line_data,
-		s_data,
-		z_data,
-		l_data,
-		r_data,
-		t_data
-	};
-	static int piece_data_len = sizeof(piece_data) / sizeof(piece_data[0]);
-	static int colors[] = { RED, GREEN, YELLOW, BLUE, FUCHSIA, CYAN, WHITE };
+tetris_piece_s get_next_piece1() { // 2p ÷̾  next piece
 	int next_piece_index = random() % piece_data_len;
 	int *next_piece_data = piece_data[next_piece_index];
 	tetris_piece_s next_piece;
@@ -523,12 +676,11 @@ tetris_piece_s get_next_piece1(int visible) { // 2p 
 	next_piece.origin_y = NEXT_Y;
 	next_piece.x = 0;
 	next_piece.y = 0;
-	next_piece.color = colors[random() % (sizeof(colors) / sizeof(colors[0]))];
+	next_piece.color = piece_colors[random() % piece_colors_len];
 	next_piece.data = next_piece_data + 1;
 	next_piece.symmetry = *next_piece_data;
 	next_piece.orientation = random() % next_piece.symmetry;
 	strcpy(next_piece.empty_cell, NEXT_EMPTY_CELL);
-	draw_piece(next_piece, visible);
 	return next_piece;
 }
 
@@ -554,45 +706,377 @@ void redraw_screen1(int help_visible, tetris_piece_s next_piece, int next_visibl
 }
 
 
-tetris_piece_s get_current_piece(tetris_piece_s next_piece, int *playfield) {
+tetris_piece_s get_current_piece(tetris_piece_s next_piece) {
     tetris_piece_s current_piece = next_piece;
     current_piece.x = (PLAYFIELD_W - 4) / 2;
     current_piece.y = 0;
     current_piece.origin_x = PLAYFIELD_X;
     current_piece.origin_y = PLAYFIELD_Y;
     strcpy(current_piece.empty_cell, PLAYFIELD_EMPTY_CELL);
-    if (!position_ok(current_piece, playfield, NULL)) {
-        cmd_quit();
-    }
-    draw_piece(next_piece, 0);
-    draw_piece(current_piece, 1);
-    return current_piece;
+    return current_piece; // main quits when it doesn't fit, after publishing the final board
 }
 
-tetris_piece_s get_current_piece1(tetris_piece_s next_piece, int *playfield) { // 2p ÷̾   block
+tetris_piece_s get_current_piece1(tetris_piece_s next_piece) { // 2p ÷̾   block
 	tetris_piece_s current_piece = next_piece;
 	current_piece.x = (PLAYFIELD_W - 4) / 2;
 	current_piece.y = 0;
 	current_piece.origin_x = PLAYFIELD_XX;
 	current_piece.origin_y = PLAYFIELD_Y;
 	strcpy(current_piece.empty_cell, PLAYFIELD_EMPTY_CELL);
-	if (!position_ok(current_piece, playfield, NULL)) {
-		cmd_quit();
-	}
-	draw_piece(next_piece, 0);
-	draw_piece(current_piece, 1);
 	return current_piece;
 } // ߰
 
+/*
+ * Render thread.
+ *
+ * The game thread never writes to the terminal: after every key or gravity
+ * tick it copies the visible state into a frame_s and publishes it through
+ * a single-producer/single-consumer ring. The render thread takes only the
+ * newest frame, diffs it against the one on screen and does the printf and
+ * fflush calls itself, so a congested stdout can't delay get_key.
+ */
+
+#define FRAME_QUEUE_SIZE 16 // power of two
+#define FRAME_RETRY_DELAY 2000 // us before republishing a frame the full ring rejected
+
+typedef struct {
+    int playfield[2][PLAYFIELD_H];
+    tetris_piece_s current[2];
+    tetris_piece_s next[2];
+    int help_visible;
+    int next_visible;
+    int use_color;
+} frame_s;
+
+static frame_s frame_queue[FRAME_QUEUE_SIZE];
+static _Alignas(64) atomic_size_t frame_head; // advanced by the render thread
+static _Alignas(64) atomic_size_t frame_tail; // advanced by the game thread
+static atomic_int render_quit;
+static sem_t frame_ready;
+static pthread_t render_thread_id;
+static int render_running = 0;
+
+int frame_publish(const frame_s *frame) { // returns 0 when the ring is full
+    size_t tail = atomic_load_explicit(&frame_tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&frame_head, memory_order_acquire) == FRAME_QUEUE_SIZE) {
+        return 0;
+    }
+    frame_queue[tail & (FRAME_QUEUE_SIZE - 1)] = *frame;
+    atomic_store_explicit(&frame_tail, tail + 1, memory_order_release);
+    sem_post(&frame_ready);
+    return 1;
+}
+
+static int frame_take_latest(frame_s *frame) { // drops every older frame still queued
+    size_t tail = atomic_load_explicit(&frame_tail, memory_order_acquire);
+
+    if (tail == atomic_load_explicit(&frame_head, memory_order_relaxed)) {
+        return 0;
+    }
+    *frame = frame_queue[(tail - 1) & (FRAME_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&frame_head, tail, memory_order_release);
+    return 1;
+}
+
+static int piece_changed(tetris_piece_s *a, tetris_piece_s *b) {
+    return a->data != b->data || a->color != b->color || a->x != b->x || a->y != b->y || a->orientation != b->orientation;
+}
+
+/*
+ * Scroll-region playfield repaint.
+ *
+ * Line clears and garbage mostly shift the stack vertically. When the
+ * terminal supports left/right margins (DECLRMM, probed at startup), the
+ * board is fenced in with DECSLRM/DECSTBM and its rows are moved with
+ * delete-line/insert-line, so only exposed or changed rows get repainted.
+ * The edit script comes from a longest-common-subsequence match between
+ * the rows on screen and the new playfield.
+ */
+
+int scroll_margins = 0; // terminal accepted DECLRMM
+
+static void scroll_region_begin(int origin_x) {
+    reset_colors();
+    printf("\033[?69h\033[%d;%ds\033[%d;%dr", origin_x, origin_x + PLAYFIELD_W * 2 - 1,
+           PLAYFIELD_Y, PLAYFIELD_Y + PLAYFIELD_H - 1);
+}
+
+static void scroll_region_end() {
+    printf("\033[r\033[?69l"); // leaving DECLRMM also drops the left/right margins
+}
+
+// screen holds what the terminal shows (-1: unknown); on return it matches playfield.
+void draw_playfield_scrolled(int origin_x, int *screen, int *playfield) {
+    int lcs[PLAYFIELD_H + 1][PLAYFIELD_H + 1];
+    int deleted[PLAYFIELD_H] = {};
+    int inserted[PLAYFIELD_H] = {};
+    int shifted = 0;
+    int repaint = 0; // rows a plain repaint would redraw
+    int exposed = 0; // rows left to redraw after scrolling
+    int done = 0;
+    int i = 0;
+    int j = 0;
+    int k = 0;
+
+    TRACE_BEGIN("draw_playfield");
+    for (i = PLAYFIELD_H; i >= 0; i--) {
+        for (j = PLAYFIELD_H; j >= 0; j--) {
+            if (i == PLAYFIELD_H || j == PLAYFIELD_H) {
+                lcs[i][j] = 0;
+            } else if (screen[i] == playfield[j] && screen[i] >= 0) {
+                lcs[i][j] = lcs[i + 1][j + 1] + 1;
+            } else {
+                lcs[i][j] = lcs[i + 1][j] > lcs[i][j + 1] ? lcs[i + 1][j] : lcs[i][j + 1];
+            }
+        }
+    }
+    for (i = 0, j = 0; i < PLAYFIELD_H || j < PLAYFIELD_H;) {
+        if (i < PLAYFIELD_H && j < PLAYFIELD_H && screen[i] == playfield[j] && screen[i] >= 0 &&
+            lcs[i][j] == lcs[i + 1][j + 1] + 1) {
+            shifted |= (i != j);
+            i++;
+            j++;
+        } else if (j == PLAYFIELD_H || (i < PLAYFIELD_H && lcs[i + 1][j] >= lcs[i][j + 1])) {
+            deleted[i++] = 1;
+        } else {
+            inserted[j++] = 1;
+        }
+    }
+
+    for (j = 0; j < PLAYFIELD_H; j++) {
+        repaint += (screen[j] != playfield[j]);
+        exposed += inserted[j];
+    }
+
+    if (shifted && exposed < repaint) { // delete first so matched rows never fall off the bottom, then open the gaps
+        scroll_region_begin(origin_x);
+        for (i = 0; i < PLAYFIELD_H; i++) {
+            if (!deleted[i]) {
+                continue;
+            }
+            for (k = 1; i + k < PLAYFIELD_H && deleted[i + k]; k++) {
+            }
+            printf("\033[%d;%dH\033[%dM", PLAYFIELD_Y + i - done, origin_x, k);
+            memmove(screen + i - done, screen + i - done + k, (PLAYFIELD_H - (i - done) - k) * sizeof(int));
+            for (j = PLAYFIELD_H - k; j < PLAYFIELD_H; j++) {
+                screen[j] = -1;
+            }
+            done += k;
+            i += k - 1;
+        }
+        for (j = 0; j < PLAYFIELD_H; j++) {
+            if (!inserted[j]) {
+                continue;
+            }
+            for (k = 1; j + k < PLAYFIELD_H && inserted[j + k]; k++) {
+            }
+            printf("\033[%d;%dH\033[%dL", PLAYFIELD_Y + j, origin_x, k);
+            memmove(screen + j + k, screen + j, (PLAYFIELD_H - j - k) * sizeof(int));
+            for (i = j; i < j + k; i++) {
+                screen[i] = -1;
+            }
+            j += k - 1;
+        }
+        scroll_region_end();
+    }
+    for (j = 0; j < PLAYFIELD_H; j++) {
+        if (screen[j] != playfield[j]) {
+            draw_playfield_row(origin_x, PLAYFIELD_Y + j, playfield[j]);
+            screen[j] = playfield[j];
+        }
+    }
+    TRACE_END("draw_playfield");
+}
+
+static void render_frame(frame_s *frame, frame_s *shown) {
+    int screen[PLAYFIELD_H];
+    int p = 0;
+
+    use_color = frame->use_color;
+    if (!shown || shown->use_color != frame->use_color) {
+        hide_cursor();
+        redraw_screen(frame->help_visible, frame->next[0], frame->next_visible, frame->current[0], frame->playfield[0]);
+        redraw_screen1(frame->help_visible, frame->next[1], frame->next_visible, frame->current[1], frame->playfield[1]);
+        return;
+    }
+    if (shown->help_visible != frame->help_visible) {
+        draw_help(frame->help_visible);
+        draw_help1(frame->help_visible);
+    }
+    for (p = 0; p < 2; p++) {
+        if (memcmp(shown->playfield[p], frame->playfield[p], sizeof(frame->playfield[p])) != 0) {
+            if (scroll_margins) { // shift what is on screen, piece included
+                memcpy(screen, shown->playfield[p], sizeof(screen));
+                flatten_piece(&shown->current[p], screen);
+                draw_playfield_scrolled(p == 0 ? PLAYFIELD_X : PLAYFIELD_XX, screen, frame->playfield[p]);
+            } else if (p == 0) {
+                draw_playfield(frame->playfield[p]);
+            } else {
+                draw_playfield1(frame->playfield[p]);
+            }
+            if (position_ok(frame->current[p], frame->playfield[p], NULL)) { // a piece that doesn't fit topped out, keep the board visible
+                draw_piece(frame->current[p], 1);
+            }
+        } else if (piece_changed(&shown->current[p], &frame->current[p])) {
+            draw_piece(shown->current[p], 0);
+            draw_piece(frame->current[p], 1);
+        }
+        if (shown->next_visible != frame->next_visible || piece_changed(&shown->next[p], &frame->next[p])) {
+            draw_piece(shown->next[p], 0);
+            draw_piece(frame->next[p], frame->next_visible);
+        }
+    }
+}
+
+static void *render_thread(void *arg) {
+    frame_s frame;
+    frame_s shown;
+    int have_shown = 0;
+    int quit = 0;
+
+    (void)arg;
+    TRACE_THREAD("render");
+    while (!quit) {
+        sem_wait(&frame_ready);
+        quit = atomic_load_explicit(&render_quit, memory_order_acquire); // read first so the last frame is still taken
+        if (frame_take_latest(&frame)) {
+            TRACE_BEGIN("render_frame");
+            render_frame(&frame, have_shown ? &shown : NULL);
+            TRACE_END("render_frame");
+            TRACE_BEGIN("fflush");
+            fflush(stdout);
+            TRACE_END("fflush");
+            shown = frame;
+            have_shown = 1;
+        }
+    }
+    return NULL;
+}
+
+void render_start() {
+    sem_init(&frame_ready, 0, 0);
+    pthread_create(&render_thread_id, NULL, render_thread, NULL);
+    render_running = 1;
+}
+
+void render_stop() { // draws whatever was published last, then joins the render thread
+    if (!render_running) {
+        return;
+    }
+    atomic_store_explicit(&render_quit, 1, memory_order_release);
+    sem_post(&frame_ready);
+    pthread_join(render_thread_id, NULL);
+    render_running = 0;
+}
+
+static tetris_piece_s bench_piece(int x, int y) { // vertical I piece on the 1p board
+    tetris_piece_s piece;
+
+    piece.origin_x = PLAYFIELD_X;
+    piece.origin_y = PLAYFIELD_Y;
+    piece.x = x;
+    piece.y = y;
+    piece.color = CYAN;
+    piece.data = line_data + 1;
+    piece.symmetry = line_data[0];
+    piece.orientation = 0;
+    strcpy(piece.empty_cell, PLAYFIELD_EMPTY_CELL);
+    return piece;
+}
+
+static long render_bytes(frame_s *frame, frame_s *shown) { // stdout must be a regular file here
+    off_t before = 0;
+
+    fflush(stdout);
+    before = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    render_frame(frame, shown);
+    fflush(stdout);
+    return lseek(STDOUT_FILENO, 0, SEEK_CUR) - before;
+}
+
+// Bytes written for line clears (I piece dropped into a well) and garbage, with and without scroll margins.
+int run_render_benchmark() {
+    frame_s shown;
+    frame_s frame;
+    tetris_piece_s piece;
+    long bytes[2][8];
+    int saved_stdout = dup(STDOUT_FILENO);
+    FILE *sink = tmpfile();
+    int event = 0;
+    int lines = 0;
+    int mode = 0;
+    int x = 0;
+    int y = 0;
+
+    memset(&shown, 0, sizeof(shown));
+    shown.current[0] = bench_piece(3, 0);
+    shown.current[1] = bench_piece(3, 0);
+    shown.current[1].origin_x = PLAYFIELD_XX;
+    shown.next[0] = shown.current[0];
+    shown.next[1] = shown.current[1];
+    shown.help_visible = 1;
+    shown.next_visible = 1;
+    shown.use_color = 1;
+
+    fflush(stdout);
+    dup2(fileno(sink), STDOUT_FILENO);
+    for (event = 0; event < 8; event++) {
+        lines = event % 4 + 1;
+        memset(shown.playfield[0], 0, sizeof(shown.playfield[0]));
+        for (y = PLAYFIELD_H - 12; y < PLAYFIELD_H; y++) { // 12-row stack, well in the last column
+            for (x = 0; x < PLAYFIELD_W - 1; x++) {
+                if (y < PLAYFIELD_H - lines && x == (y * 3) % (PLAYFIELD_W - 1)) {
+                    continue;
+                }
+                shown.playfield[0][y] |= (1 + (x + y) % 7) << (x * 3);
+            }
+        }
+        frame = shown;
+        if (event < 4) {
+            shown.current[0] = bench_piece(PLAYFIELD_W - 2, 0);
+            piece = bench_piece(PLAYFIELD_W - 2, PLAYFIELD_H - 4);
+            flatten_piece(&piece, frame.playfield[0]);
+            process_complete_lines(frame.playfield[0]);
+        } else {
+            shown.current[0] = frame.current[0];
+            for (y = 0; y < lines; y++) {
+                push_garbage_line(frame.playfield[0], 2);
+            }
+        }
+        for (mode = 0; mode < 2; mode++) {
+            scroll_margins = mode;
+            bytes[mode][event] = render_bytes(&frame, &shown);
+        }
+    }
+    scroll_margins = 0;
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    fclose(sink);
+
+    printf("%-16s %12s %12s %8s\n", "event", "full repaint", "scroll", "saved");
+    for (event = 0; event < 8; event++) {
+        printf("%-7s %d %-6s %12ld %12ld %7.0f%%\n", event < 4 ? "clear" : "garbage", event % 4 + 1,
+               event % 4 ? "lines" : "line", bytes[0][event], bytes[1][event],
+               100.0 * (bytes[0][event] - bytes[1][event]) / bytes[0][event]);
+    }
+    return 0;
+}
+
 char get_key(long delay) {
     static char buf[16];
     static int buf_len = 0;
     static int buf_pos = 0;
     struct timeval t;
     fd_set fs;
+    char c = 0;
 
+    TRACE_BEGIN("get_key");
     if (buf_len > 0 && buf_pos < buf_len) {
-        return buf[buf_pos++];
+        c = buf[buf_pos++];
+        TRACE_END("get_key");
+        return c;
     }
     buf_len = 0;
     buf_pos = 0;
@@ -604,178 +1088,1889 @@ char get_key(long delay) {
     }
     FD_ZERO(&fs);
     FD_SET(STDIN_FILENO, &fs);
+    TRACE_BEGIN("select"); // waiting for input, not decoding it
     select(STDIN_FILENO + 1, &fs, 0, 0, &t);
+    TRACE_END("select");
 
     if (FD_ISSET(STDIN_FILENO, &fs)) {
         buf_len = read(STDIN_FILENO, buf, 16);
         if (buf_len > 0) {
-            return buf[buf_pos++];
+            c = buf[buf_pos++];
         }
     }
-    return 0;
+    TRACE_END("get_key");
+    return c;
 }
 
-long get_current_micros() {
-    struct timeval t;
+long get_current_micros() { // monotonic, so gravity and auto-shift ignore clock changes
+    struct timespec t;
 
-    gettimeofday(&t, NULL);
-    return t.tv_usec + t.tv_sec * 1000000;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_nsec / 1000 + t.tv_sec * 1000000;
 }
 
-int main() {
-    char c = 0;
-    char key[] = {0, 0, 0};
-    tcflag_t c_lflag_orig = 0;
-    int help_visible = 1;
-    int next_visible = 1;
-    tetris_piece_s next_piece, next_piece1;// 2p next_piece1
-    tetris_piece_s current_piece, current_piece1; // 2p current_piecee1
-    int playfield[PLAYFIELD_H] = {};
-	int playfield1[PLAYFIELD_H] = {}; // 2p playfield ߰
-    int i = 0;
-    int flags = fcntl(STDOUT_FILENO, F_GETFL);
-    long last_down_time = 0;
-    long now = 0;
+/*
+ * Input: terminal capability probe, kitty keyboard protocol decoding and
+ * delayed auto-shift.
+ *
+ * Horizontal movement no longer follows the terminal's key repeat. The
+ * first press shifts once; while the key stays held, das_update() shifts
+ * again after the player's DAS delay and then every ARR microseconds,
+ * driven by the monotonic clock. Terminals speaking the kitty keyboard
+ * protocol report press/repeat/release, so holds are exact. Elsewhere every
+ * key event still moves once until the stream shows the terminal's repeat
+ * pattern: a first-repeat delay after the press, then two gaps of at most
+ * DAS_REPEAT_GAP and a third of that delay. Evenly spaced taps never match,
+ * however fast. The moves already made count as the hold's first shifts,
+ * DAS from the original press and ARR from the last move, so confirming
+ * never adds shifts. ARR then applies until the repeats stop, which can add
+ * a shift or two after release at fast ARR.
+ */
 
-    fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK);
-    tcgetattr(STDIN_FILENO, &terminal_conf);
-    c_lflag_orig = terminal_conf.c_lflag;
-    terminal_conf.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &terminal_conf);
-    terminal_conf.c_lflag = c_lflag_orig;
+#define KEY_PRESS 1
+#define KEY_REPEAT 2
+#define KEY_RELEASE 3
 
-    last_down_time = get_current_micros();
-    srandom(time(NULL));
-    for (i = 0; i < PLAYFIELD_H; i++) {
-        playfield[i] = 0;
-    }
-    hide_cursor();
-    next_piece = get_next_piece(next_visible);
-    current_piece = get_current_piece(next_piece, playfield);
-    next_piece = get_next_piece(next_visible);
+#define DAS_DELAY 167000 // us, 10 frames at 60 Hz
+#define DAS_ARR 33000 // us between auto-shifts, 0: straight to the wall
+#define DAS_DASH_POLL 1000 // us between re-dashes while an ARR 0 key is held
+#define DAS_REPEAT_GAP 50000 // key-stream mode: longest gap between terminal repeats of a held key, faster than any tapping
+#define DAS_REPEAT_DELAY 700000 // key-stream mode: longest terminal delay before the first repeat
+#define DAS_LIMIT_MS 10000 // --das ceiling for DAS and ARR
 
-	next_piece1 = get_next_piece1(next_visible);//2p ʱ block 
-	current_piece1 = get_current_piece1(next_piece1, playfield1);//2p ʱ block ǥ
-	next_piece1 = get_next_piece1(next_visible);//2p  block 
+typedef struct {
+    long das;
+    long arr;
+    long repeat_interval; // smoothed gap between terminal repeats, key-stream mode
+    int dir; // -1 left, 1 right, 0 not held
+    int confirmed; // hold is known, auto-shift may run
+    int repeats; // key-stream mode: events matching the repeat pattern since the press
+    long repeat_delay; // key-stream mode: gap from the press to the first repeat candidate
+    long pressed_at;
+    long last_seen;
+    long next_shift;
+    long last_shift_at;
+    long shifts; // achieved cadence, reported on quit
+    long interval_sum;
+    long interval_min;
+    long interval_max;
+    long das_sum;
+    long das_count;
+} das_s;
+
+das_s das[2] = {
+    { .das = DAS_DELAY, .arr = DAS_ARR },
+    { .das = DAS_DELAY, .arr = DAS_ARR }
+};
+int kitty_keyboard = 0; // terminal reports key press/repeat/release
+
+void probe_terminal() { // asks for DECLRMM (DECRQM ?69) and kitty keyboard flags, DA1 marks the end of the replies
+    char buf[128];
+    char *p = NULL;
+    int len = 0;
+    int mode = 0;
+    struct timeval t;
+    fd_set fs;
 
-    redraw_screen(help_visible, next_piece, next_visible, current_piece, playfield);
-	redraw_screen1(help_visible, next_piece1, next_visible, current_piece1, playfield1);// ߰
+    printf("\033[?69$p\033[?u\033[c");
     fflush(stdout);
-    while(1) {
-        now = get_current_micros();
-        c = get_key(last_down_time + tetris_delay - now);
-        key[2] = key[1];
-        key[1] = key[0];
-        if (key[2] == ESC && key[1] == '[') {
-            key[0] = c;
-        } else {
-            key[0] = tolower(c);
+    while (len < (int)sizeof(buf) - 1) {
+        t.tv_sec = 0;
+        t.tv_usec = 300000;
+        FD_ZERO(&fs);
+        FD_SET(STDIN_FILENO, &fs);
+        if (select(STDIN_FILENO + 1, &fs, 0, 0, &t) <= 0 || read(STDIN_FILENO, buf + len, 1) != 1) {
+            break;
         }
-        switch(key[0]) {
-            case 3:
-            case 'q':
-                cmd_quit();
-                break;
-            //case 'C'://
-            case 'g':
-                cmd_right(&current_piece, playfield);
-                break;
-            //case 'D'://
-            case 'd':
-                cmd_left(&current_piece, playfield);
-                break;
-            //case 'A'://
-            case 'r':
-                cmd_rotate(&current_piece, playfield);
-                break;
-            case 'f':
-                last_down_time = get_current_micros();
-                if (!cmd_down(&current_piece, playfield, playfield1)) { // block ٴڿ ϸ
-					while (attack2 > 0) { // player 2  īƮ 
-						for (i = 0; i < 19; i++) // ĭ  shift
-							*(playfield + i) = *(playfield + i + 1);
-						*(playfield + 19) = 7;
-						for (i = 0; i < 9; i++) { //  Ʒĭ  ä
-							*(playfield + 19) = (*(playfield + 19) << 3) + 7; // 3bit  1 
-						}
-						*(playfield + 19) = *(playfield + 19) ^ (7 << 3 * ((rand() % 8)));//(rand() % 8) + 1
-						//    1 Ȯ (XOR)
-						attack2--;
-					}
-					draw_playfield(playfield); // player ȭ 
+        if (buf[len++] == 'c') {
+            break;
+        }
+    }
+    buf[len] = 0;
+    p = strstr(buf, "\033[?69;");
+    if (p && sscanf(p, "\033[?69;%d$", &mode) == 1) {
+        scroll_margins = (mode >= 1 && mode <= 3);
+    }
+    for (p = strstr(buf, "\033[?"); p; p = strstr(p + 1, "\033[?")) {
+        p += 3;
+        while (isdigit(*p)) {
+            p++;
+        }
+        if (*p == 'u') {
+            kitty_keyboard = 1;
+        }
+    }
+    if (kitty_keyboard) {
+        printf("\033[>11u"); // disambiguate, report event types, all keys as escape codes
+    }
+}
 
+char get_input(long delay, int *event) { // get_key, with kitty CSI u sequences decoded
+    char c = get_key(delay);
+    int params[4] = { 0, 0, 1, KEY_PRESS }; // key, alternate key, modifiers, event
+    int n = 0;
 
-                    current_piece = get_current_piece(next_piece, playfield);
-                    next_piece = get_next_piece(next_visible);
-                }
-                break;
-            case 'a':
-				cmd_drop(&current_piece, playfield, playfield1);
-				while (attack2 > 0) {
-					for (i = 0; i < 19; i++)
-						*(playfield + i) = *(playfield + i + 1);
-					*(playfield + 19) = 7;
-					for (i = 0; i < 9; i++) {
-						*(playfield + 19) = (*(playfield + 19) << 3) + 7;
-					}
-					*(playfield + 19) = *(playfield + 19) ^ (7 << 3 * ((rand() % 8)));//(rand() % 8) + 1
-					attack2--;
-				}
-				
-				draw_playfield(playfield);
-                current_piece = get_current_piece(next_piece, playfield);
-                next_piece = get_next_piece(next_visible);
-                break;
-				//
-				//case 'C'://
-			case '6':
-				cmd_right(&current_piece1, playfield1);//߰
-				break;
-				//case 'D'://
-			case '4':
-				cmd_left(&current_piece1, playfield1);//߰
-				break;
-				//case 'A'://
-			case '8':
-				cmd_rotate(&current_piece1, playfield1);//߰
-				break;
-			case '5':
-				last_down_time = get_current_micros();
-				if (!cmd_down1(&current_piece1, playfield1,playfield)) {
-					while (attack1 > 0) {
-						for (i = 0; i < 19; i++)
-							*(playfield1 + i) = *(playfield1 + i + 1);
-						*(playfield1 + 19) = 7;
-						for (i = 0; i < 9; i++) {
-							*(playfield1 + 19) = (*(playfield1 + 19) << 3) + 7;
-						}
-						*(playfield1 + 19) = *(playfield1 + 19) ^ (7 << 3 * ((rand() % 8)));//(rand() % 8) + 1
-						attack1--;
-					}
-					
-					draw_playfield1(playfield1);
+    *event = KEY_PRESS;
+    if (!kitty_keyboard || c != ESC) {
+        return c;
+    }
+    c = get_key(0);
+    if (c != '[') {
+        return c ? c : ESC;
+    }
+    while ((c = get_key(0)) != 0 && (isdigit(c) || c == ':' || c == ';')) {
+        if (c == ':' || c == ';') {
+            n = (c == ':') ? n + 1 : (n < 2 ? 2 : 4);
+            if (n < 4) {
+                params[n] = 0;
+            }
+        } else if (n < 4) {
+            params[n] = params[n] * 10 + (c - '0');
+        }
+    }
+    *event = params[3];
+    if (c != 'u' || params[0] >= 128) {
+        return 0;
+    }
+    if ((params[2] - 1) & 4) { // ctrl
+        return params[0] & 0x1f;
+    }
+    return params[0];
+}
 
-					current_piece1 = get_current_piece1(next_piece1, playfield1);
-					next_piece1 = get_next_piece1(next_visible);
+static void das_shift(das_s *d, long now, tetris_piece_s *piece, int *playfield) {
+    int i = 0;
 
-				}
-				break;
-			case 'p':
-				cmd_drop1(&current_piece1, playfield1, playfield);
-				while (attack1 > 0) {
-					for (i = 0; i < 19; i++)
-						*(playfield1 + i) = *(playfield1 + i + 1);
-					*(playfield1 + 19) = 7;
-					for (i = 0; i < 9; i++) {
-						*(playfield1 + 19) = (*(playfield1 + 19) << 3) + 7;
-					}
-					*(playfield1 + 19) = *(playfield1 + 19) ^ (7 << 3 * ((rand() % 8)));//(rand() % 8) + 1
+    if (d->last_shift_at) {
+        d->interval_sum += now - d->last_shift_at;
+        if (d->shifts == d->das_count || now - d->last_shift_at < d->interval_min) { // first interval
+            d->interval_min = now - d->last_shift_at;
+        }
+        if (now - d->last_shift_at > d->interval_max) {
+            d->interval_max = now - d->last_shift_at;
+        }
+    } else {
+        d->das_sum += now - d->pressed_at;
+        d->das_count++;
+    }
+    d->last_shift_at = now;
+    d->shifts++;
+    for (i = 0; i < (d->arr ? 1 : PLAYFIELD_W); i++) {
+        if (d->dir > 0) {
+            cmd_right(piece, playfield);
+        } else {
+            cmd_left(piece, playfield);
+        }
+    }
+}
+
+void das_key(das_s *d, int dir, int event, long now, tetris_piece_s *piece, int *playfield) {
+    long gap = (d->dir == dir) ? now - d->last_seen : LONG_MAX;
+
+    if (event == KEY_RELEASE) {
+        if (d->dir == dir) {
+            d->dir = 0;
+        }
+        return;
+    }
+    if (event == KEY_REPEAT) { // kitty: the key is still down, das_update does the shifting
+        return;
+    }
+    if (!kitty_keyboard && d->confirmed && gap <= 2 * d->repeat_interval) { // the hold goes on, das_update shifts
+        d->repeat_interval = (d->repeat_interval * 3 + gap) / 4;
+        d->last_seen = now;
+        return;
+    }
+    if (!kitty_keyboard && !d->confirmed && d->repeats > 0 && gap <= DAS_REPEAT_GAP && gap * 3 <= d->repeat_delay) {
+        d->repeats++; // a tight repeat after the first-repeat delay
+    } else if (!kitty_keyboard && d->repeats == 0 && gap <= DAS_REPEAT_DELAY) {
+        d->repeats = 1; // possibly the terminal's first repeat: keep the hold starting at the press
+        d->repeat_delay = gap;
+    } else {
+        d->repeats = 0;
+        d->pressed_at = now;
+    }
+    if (dir > 0) { // key stream events move once each until the hold is confirmed
+        cmd_right(piece, playfield);
+    } else {
+        cmd_left(piece, playfield);
+    }
+    d->dir = dir;
+    d->confirmed = kitty_keyboard;
+    d->last_seen = now;
+    d->next_shift = now + d->das;
+    d->last_shift_at = 0;
+    if (d->repeats >= 3) { // delay, then two tight gaps: the terminal is repeating a held key
+        d->confirmed = 1;
+        d->repeat_interval = gap;
+        d->next_shift = d->pressed_at + d->das + d->repeats * d->arr; // the repeats + 1 moves so far were shifts
+        if (d->next_shift < now + d->arr) {
+            d->next_shift = now + d->arr;
+        }
+    }
+}
+
+void das_update(das_s *d, long now, tetris_piece_s *piece, int *playfield) {
+    long held_until = LONG_MAX;
+    int i = 0;
+
+    if (!d->dir) {
+        return;
+    }
+    if (!kitty_keyboard) { // without release events a hold lasts as long as the repeats keep coming
+        held_until = d->last_seen + 2 * d->repeat_interval;
+    }
+    for (i = 0; d->confirmed && i < PLAYFIELD_W && d->next_shift <= now && d->next_shift <= held_until; i++) {
+        das_shift(d, now, piece, playfield);
+        d->next_shift = d->arr ? d->next_shift + d->arr : now + DAS_DASH_POLL;
+    }
+    if (d->next_shift <= now) { // too far behind to catch up, keep the cadence from here
+        d->next_shift = now + (d->arr ? d->arr : DAS_DASH_POLL);
+    }
+    if (d->confirmed && now > held_until) {
+        d->dir = 0;
+    }
+}
+
+long das_deadline(das_s *d) {
+    return (d->dir && d->confirmed) ? d->next_shift : LONG_MAX;
+}
+
+typedef struct {
+    const char *name;
+    int columns; // expected movement
+    long events[16]; // ms, key-stream right-key events, -1 terminated
+} das_case_s;
+
+// Replays fixed key-stream timings through das_key and das_update in 1 ms steps, default DAS and ARR.
+int run_das_test() {
+    static const das_case_s cases[] = {
+        { "taps 90 ms apart", 3, { 0, 90, 180, -1 } },
+        { "taps 60 ms apart", 4, { 0, 60, 120, 180, -1 } },
+        { "taps 40 ms apart", 3, { 0, 40, 80, -1 } },
+        { "pause, then taps 90 ms apart", 4, { 0, 300, 390, 480, -1 } },
+        { "hold, 500 ms delay", 5, { 0, 500, 530, 560, -1 } },
+        { "hold, 200 ms delay", 7, { 0, 200, 230, 260, 290, 320, -1 } }
+    };
+    int playfield[PLAYFIELD_H] = {};
+    tetris_piece_s piece;
+    das_s d;
+    int failed = 0;
+    int left = 0;
+    int c = 0;
+    int e = 0;
+    long t = 0;
+
+    kitty_keyboard = 0;
+    for (c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++) {
+        memset(&d, 0, sizeof(d));
+        d.das = DAS_DELAY;
+        d.arr = DAS_ARR;
+        piece = bench_piece(0, 0);
+        for (e = 0; e < PLAYFIELD_W; e++) { // start against the left wall, 9 columns of room
+            cmd_left(&piece, playfield);
+        }
+        left = piece.x;
+        for (e = 0, t = 0; t < 2000; t++) {
+            if (cases[c].events[e] == t) {
+                das_key(&d, 1, KEY_PRESS, t * 1000, &piece, playfield);
+                e++;
+            }
+            das_update(&d, t * 1000, &piece, playfield);
+        }
+        printf("%-32s %d columns, expected %d\n", cases[c].name, piece.x - left, cases[c].columns);
+        failed |= (piece.x - left != cases[c].columns);
+    }
+    printf("%s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
+
+int input_stop(int y) { // leaves kitty mode and prints the achieved auto-shift cadence, returns rows used
+    char buf[128];
+    int rows = 0;
+    int p = 0;
+
+    if (kitty_keyboard) {
+        printf("\033[<u");
+    }
+    for (p = 0; p < 2; p++) {
+        if (!das[p].shifts) {
+            continue;
+        }
+        snprintf(buf, sizeof(buf), "P%d auto-shift: %ld shifts, DAS %.1f ms (set %.1f), ARR %.1f ms avg, %.1f-%.1f (set %.1f)",
+                 p + 1, das[p].shifts, das[p].das_count ? das[p].das_sum / 1000.0 / das[p].das_count : 0, das[p].das / 1000.0,
+                 das[p].shifts > das[p].das_count ? das[p].interval_sum / 1000.0 / (das[p].shifts - das[p].das_count) : 0,
+                 das[p].interval_min / 1000.0, das[p].interval_max / 1000.0, das[p].arr / 1000.0);
+        xyprint(GAMEOVER_X, y + rows++, buf);
+    }
+    return rows;
+}
+
+/*
+ * Self-play boards.
+ *
+ * A board plus its piece and pending garbage, stepped without a terminal.
+ * The dataset generator, libtetris and the match server all play on these.
+ */
+
+typedef struct {
+    int playfield[PLAYFIELD_H];
+    tetris_piece_s piece;
+    int piece_index;
+    int next_index;
+    int attack; // lines waiting to be pushed onto this board
+    int moves;
+} selfplay_board_s;
+
+static uint64_t selfplay_random(uint64_t *state) { // xorshift64*, random() takes a lock
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static void selfplay_spawn(selfplay_board_s *board, int index, uint64_t *rng) {
+    int *data = piece_data[index];
+
+    board->piece_index = index;
+    board->piece.origin_x = PLAYFIELD_X;
+    board->piece.origin_y = PLAYFIELD_Y;
+    board->piece.x = (PLAYFIELD_W - 4) / 2;
+    board->piece.y = 0;
+    board->piece.color = piece_colors[selfplay_random(rng) % piece_colors_len];
+    board->piece.data = data + 1;
+    board->piece.symmetry = *data;
+    board->piece.orientation = selfplay_random(rng) % board->piece.symmetry;
+    strcpy(board->piece.empty_cell, PLAYFIELD_EMPTY_CELL);
+}
+
+static void selfplay_reset(selfplay_board_s *board, uint64_t *rng) {
+    memset(board->playfield, 0, sizeof(board->playfield));
+    board->attack = 0;
+    board->moves = 0;
+    selfplay_spawn(board, selfplay_random(rng) % piece_data_len, rng);
+    board->next_index = selfplay_random(rng) % piece_data_len;
+}
+
+// Locks the piece, passes garbage by main's rule and spawns the next one. Self-play and libtetris
+// both lock through here so their rules can't drift apart. Returns lines cleared, -1 on top-out.
+static int selfplay_lock_piece(selfplay_board_s *board, selfplay_board_s *opponent, uint64_t *rng) {
+    int lines = 0;
+
+    flatten_piece(&board->piece, board->playfield);
+    lines = process_complete_lines(board->playfield);
+    if (lines > 0) { // as in process_fallen_piece: the latest clear replaces any garbage still waiting
+        opponent->attack = lines;
+    }
+    while (board->attack > 0) {
+        push_garbage_line(board->playfield, selfplay_random(rng) % 8);
+        board->attack--;
+    }
+    selfplay_spawn(board, board->next_index, rng);
+    board->next_index = selfplay_random(rng) % piece_data_len;
+    if (!position_ok(board->piece, board->playfield, NULL)) {
+        return -1;
+    }
+    return lines;
+}
+
+/*
+ * Headless self-play dataset generator.
+ *
+ * Each simulation thread plays 2p battles with a greedy placement bot and
+ * pushes one dataset_record_s per placement into its own bounded SPSC queue.
+ * A single writer thread drains every queue straight into gzip shards
+ * (<dir>/shard-NNNNN.bin.gz), so simulation never waits on the disk.
+ *
+ * Shard layout (after gunzip): dataset_header_s, then fixed-size records.
+ */
+
+#ifndef TETRIS_LIBRARY
+#define DATASET_MAGIC 0x53525454 // "TTRS"
+#define DATASET_VERSION 1
+#define DATASET_QUEUE_SIZE 8192 // records per queue, power of two
+#define DATASET_SHARD_RECORDS (1 << 20)
+#define DATASET_MAX_MOVES 2000 // placements per player before a battle is restarted
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint16_t playfield_w;
+    uint16_t playfield_h;
+    uint32_t reserved;
+} dataset_header_s;
+
+typedef struct {
+    uint32_t playfield[PLAYFIELD_H]; // board before placement, 3 bits per cell
+    uint8_t piece;          // index into piece_data
+    uint8_t orientation;    // spawn orientation
+    uint8_t next_piece;     // preview piece index
+    int8_t placement_x;
+    uint8_t placement_orientation;
+    uint8_t lines;          // lines cleared by this placement
+    uint8_t garbage;        // garbage lines received after it
+    uint8_t player;
+} dataset_record_s;
+
+typedef struct {
+    _Alignas(64) atomic_size_t head; // written by the writer thread only
+    _Alignas(64) atomic_size_t tail; // written by the simulation thread only
+    _Alignas(64) atomic_int done;
+    long stalls;
+    dataset_record_s records[DATASET_QUEUE_SIZE];
+} dataset_queue_s;
+
+typedef struct {
+    dataset_queue_s *queue;
+    long records;
+    uint64_t seed;
+} dataset_sim_s;
+
+typedef struct {
+    dataset_queue_s **queues;
+    int queue_count;
+    const char *dir;
+    long written;
+    int shards;
+} dataset_writer_s;
+
+static int selfplay_evaluate(int *playfield, int lines) { // weights from the usual 4-feature Tetris heuristic, scaled by 1000
+    int heights[PLAYFIELD_W] = {};
+    unsigned int seen = 0; // lowest bit of every cell that is filled at or above the current row
+    unsigned int filled = 0;
+    unsigned int fresh = 0;
+    int x = 0;
+    int y = 0;
+    int aggregate = 0;
+    int holes = 0;
+    int bumpiness = 0;
+
+    for (y = 0; y < PLAYFIELD_H; y++) {
+        filled = (*(playfield + y) | *(playfield + y) >> 1 | *(playfield + y) >> 2) & 01111111111;
+        holes += __builtin_popcount(seen & ~filled);
+        for (fresh = filled & ~seen; fresh; fresh &= fresh - 1) {
+            heights[__builtin_ctz(fresh) / 3] = PLAYFIELD_H - y;
+        }
+        seen |= filled;
+    }
+    for (x = 0; x < PLAYFIELD_W; x++) {
+        aggregate += heights[x];
+        if (x > 0) {
+            bumpiness += abs(heights[x] - heights[x - 1]);
+        }
+    }
+    return lines * 760 - aggregate * 510 - holes * 356 - bumpiness * 184;
+}
+
+// Picks the best drop for board->piece; returns 0 when the piece can't be placed at all.
+static int selfplay_place(selfplay_board_s *board, uint64_t *rng, int *best_position, int *lines) {
+    int position[3];
+    int trial[PLAYFIELD_H];
+    int o = 0;
+    int x = 0;
+    int score = 0;
+    int best = 0;
+    int found = 0;
+    int cleared = 0;
+    tetris_piece_s piece = board->piece;
+
+    for (o = 0; o < piece.symmetry; o++) {
+        for (x = -3; x < PLAYFIELD_W; x++) {
+            position[0] = x;
+            position[1] = 0;
+            position[2] = o;
+            if (!position_ok(piece, board->playfield, position)) {
+                continue;
+            }
+            do {
+                position[1]++;
+            } while (position_ok(piece, board->playfield, position));
+            position[1]--;
+
+            memcpy(trial, board->playfield, sizeof(trial));
+            piece.x = position[0];
+            piece.y = position[1];
+            piece.orientation = position[2];
+            flatten_piece(&piece, trial);
+            cleared = process_complete_lines(trial);
+            score = selfplay_evaluate(trial, cleared) + (int)(selfplay_random(rng) % 64);
+            if (!found || score > best) {
+                found = 1;
+                best = score;
+                memcpy(best_position, position, sizeof(position));
+                *lines = cleared;
+            }
+        }
+    }
+    return found;
+}
+
+static void dataset_push(dataset_queue_s *queue, const dataset_record_s *record) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    while (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == DATASET_QUEUE_SIZE) {
+        queue->stalls++;
+        sched_yield();
+    }
+    queue->records[tail & (DATASET_QUEUE_SIZE - 1)] = *record;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+static void *dataset_sim_thread(void *arg) {
+    dataset_sim_s *sim = arg;
+    selfplay_board_s boards[2];
+    selfplay_board_s *board = NULL;
+    dataset_record_s record;
+    uint64_t rng = sim->seed | 1;
+    int position[3];
+    int lines = 0;
+    int player = 0;
+    long produced = 0;
+    int i = 0;
+
+    selfplay_reset(&boards[0], &rng);
+    selfplay_reset(&boards[1], &rng);
+    while (produced < sim->records) {
+        board = &boards[player];
+        if (board->moves >= DATASET_MAX_MOVES || !position_ok(board->piece, board->playfield, NULL) ||
+            !selfplay_place(board, &rng, position, &lines)) { // game over, start a fresh battle
+            selfplay_reset(&boards[0], &rng);
+            selfplay_reset(&boards[1], &rng);
+            player = 0;
+            continue;
+        }
+        for (i = 0; i < PLAYFIELD_H; i++) {
+            record.playfield[i] = board->playfield[i];
+        }
+        record.piece = board->piece_index;
+        record.orientation = board->piece.orientation;
+        record.next_piece = board->next_index;
+        record.placement_x = position[0];
+        record.placement_orientation = position[2];
+        record.lines = lines;
+        record.player = player;
+
+        record.garbage = board->attack; // rises when this piece locks
+        board->piece.x = position[0];
+        board->piece.y = position[1];
+        board->piece.orientation = position[2];
+        selfplay_lock_piece(board, &boards[player ^ 1], &rng); // topping out is caught at this board's next turn
+        board->moves++;
+
+        dataset_push(sim->queue, &record);
+        produced++;
+        player ^= 1;
+    }
+    atomic_store_explicit(&sim->queue->done, 1, memory_order_release);
+    return NULL;
+}
+
+static int dataset_deflate(z_stream *zs, FILE *out, const void *data, size_t len, int flush) {
+    unsigned char buf[1 << 16];
+
+    zs->next_in = (unsigned char *)data;
+    zs->avail_in = len;
+    do {
+        zs->next_out = buf;
+        zs->avail_out = sizeof(buf);
+        if (deflate(zs, flush) == Z_STREAM_ERROR) {
+            return -1;
+        }
+        if (fwrite(buf, 1, sizeof(buf) - zs->avail_out, out) != sizeof(buf) - zs->avail_out) {
+            return -1;
+        }
+    } while (zs->avail_out == 0 || zs->avail_in > 0);
+    return 0;
+}
+
+static FILE *dataset_open_shard(dataset_writer_s *writer, z_stream *zs) {
+    char path[4096];
+    dataset_header_s header = { DATASET_MAGIC, DATASET_VERSION, sizeof(dataset_record_s), PLAYFIELD_W, PLAYFIELD_H, 0 };
+    FILE *out = NULL;
+
+    snprintf(path, sizeof(path), "%s/shard-%05d.bin.gz", writer->dir, writer->shards);
+    out = fopen(path, "wb");
+    if (!out) {
+        perror(path);
+        return NULL;
+    }
+    memset(zs, 0, sizeof(*zs));
+    if (deflateInit2(zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) { // +16: gzip wrapper
+        fprintf(stderr, "%s: deflateInit2 failed\n", path);
+        fclose(out);
+        return NULL;
+    }
+    if (dataset_deflate(zs, out, &header, sizeof(header), Z_NO_FLUSH)) {
+        perror(path);
+        deflateEnd(zs);
+        fclose(out);
+        return NULL;
+    }
+    writer->shards++;
+    return out;
+}
+
+static int dataset_close_shard(z_stream *zs, FILE *out) { // nonzero if the shard didn't reach the disk whole
+    int failed = dataset_deflate(zs, out, NULL, 0, Z_FINISH);
+
+    deflateEnd(zs);
+    failed |= (fclose(out) != 0);
+    return failed;
+}
+
+static void *dataset_writer_thread(void *arg) {
+    dataset_writer_s *writer = arg;
+    dataset_queue_s *queue = NULL;
+    z_stream zs;
+    FILE *out = NULL;
+    size_t in_shard = 0;
+    size_t head = 0;
+    size_t tail = 0;
+    size_t run = 0;
+    int idle = 0;
+    int done = 0;
+    int i = 0;
+
+    while (1) {
+        idle = 1;
+        done = 0;
+        for (i = 0; i < writer->queue_count; i++) {
+            queue = writer->queues[i];
+            done += atomic_load_explicit(&queue->done, memory_order_acquire);
+            head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+            tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+            while (head != tail) { // deflate straight out of the ring, at most up to the wrap or the shard end
+                if (!out) {
+                    out = dataset_open_shard(writer, &zs);
+                    if (!out) {
+                        exit(1);
+                    }
+                    in_shard = 0;
+                }
+                run = tail - head;
+                if (run > DATASET_QUEUE_SIZE - (head & (DATASET_QUEUE_SIZE - 1))) {
+                    run = DATASET_QUEUE_SIZE - (head & (DATASET_QUEUE_SIZE - 1));
+                }
+                if (run > DATASET_SHARD_RECORDS - in_shard) {
+                    run = DATASET_SHARD_RECORDS - in_shard;
+                }
+                if (dataset_deflate(&zs, out, &queue->records[head & (DATASET_QUEUE_SIZE - 1)], run * sizeof(dataset_record_s), Z_NO_FLUSH)) {
+                    perror("dataset");
+                    exit(1);
+                }
+                head += run;
+                in_shard += run;
+                writer->written += run;
+                atomic_store_explicit(&queue->head, head, memory_order_release);
+                if (in_shard == DATASET_SHARD_RECORDS) {
+                    if (dataset_close_shard(&zs, out)) {
+                        perror("dataset");
+                        exit(1);
+                    }
+                    out = NULL;
+                }
+                idle = 0;
+            }
+        }
+        if (idle) {
+            if (done == writer->queue_count) { // every queue was empty after its producer finished
+                break;
+            }
+            usleep(100);
+        }
+    }
+    if (out && dataset_close_shard(&zs, out)) {
+        perror("dataset");
+        exit(1);
+    }
+    return NULL;
+}
+
+int run_dataset(const char *dir, long records, int threads) {
+    dataset_queue_s **queues = NULL;
+    dataset_sim_s *sims = NULL;
+    pthread_t *sim_threads = NULL;
+    dataset_writer_s writer = { NULL, threads, dir, 0, 0 };
+    pthread_t writer_thread;
+    long start = 0;
+    double seconds = 0;
+    long stalls = 0;
+    int i = 0;
+
+    if (threads < 1 || records < 1) {
+        fprintf(stderr, "usage: tetris --dataset DIR [RECORDS] [THREADS]\n");
+        return 1;
+    }
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+    queues = calloc(threads, sizeof(dataset_queue_s *));
+    sims = calloc(threads, sizeof(dataset_sim_s));
+    sim_threads = calloc(threads, sizeof(pthread_t));
+    writer.queues = queues;
+    for (i = 0; i < threads; i++) {
+        if (posix_memalign((void **)&queues[i], 64, sizeof(dataset_queue_s))) {
+            perror("posix_memalign");
+            return 1;
+        }
+        memset(queues[i], 0, sizeof(dataset_queue_s));
+        sims[i].queue = queues[i];
+        sims[i].records = records / threads + (i < records % threads);
+        sims[i].seed = ((uint64_t)time(NULL) << 16) ^ (0x9e3779b97f4a7c15ULL * (i + 1));
+    }
+    start = get_current_micros();
+    pthread_create(&writer_thread, NULL, dataset_writer_thread, &writer);
+    for (i = 0; i < threads; i++) {
+        pthread_create(&sim_threads[i], NULL, dataset_sim_thread, &sims[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(sim_threads[i], NULL);
+        stalls += queues[i]->stalls;
+    }
+    pthread_join(writer_thread, NULL);
+    seconds = (get_current_micros() - start) / 1e6;
+
+    fprintf(stderr, "%ld records in %d shard(s), %.2f s, %.0f records/min, %ld queue-full stalls\n",
+            writer.written, writer.shards, seconds, writer.written / seconds * 60, stalls);
+    for (i = 0; i < threads; i++) {
+        free(queues[i]);
+    }
+    free(queues);
+    free(sims);
+    free(sim_threads);
+    return 0;
+}
+#endif
+
+/*
+ * Batched environment API exported by libtetris.so (see tetris.h).
+ *
+ * Battles reuse the self-play boards above; pieces are moved with move(),
+ * locked with flatten_piece()/process_complete_lines() and garbage goes
+ * through push_garbage_line(). As in main's battle, a clear sets the
+ * opponent's pending garbage to the lines just cleared (it does not add up)
+ * and the pending lines rise when the opponent next locks a piece.
+ */
+
+struct tetris_batch {
+    int battles;
+    int gravity_period;
+    long steps;
+    uint64_t *rng;            // one per battle
+    selfplay_board_s *boards; // two per battle
+};
+
+static int env_apply(selfplay_board_s *board, selfplay_board_s *opponent, uint64_t *rng, int action, int gravity) {
+    switch (action) {
+        case TETRIS_ACTION_LEFT:
+            move(&board->piece, board->playfield, -1, 0, 0);
+            break;
+        case TETRIS_ACTION_RIGHT:
+            move(&board->piece, board->playfield, 1, 0, 0);
+            break;
+        case TETRIS_ACTION_ROTATE:
+            move(&board->piece, board->playfield, 0, 0, 1);
+            break;
+        case TETRIS_ACTION_DOWN:
+            if (!move(&board->piece, board->playfield, 0, 1, 0)) {
+                return selfplay_lock_piece(board, opponent, rng);
+            }
+            break;
+        case TETRIS_ACTION_DROP:
+            while (move(&board->piece, board->playfield, 0, 1, 0)) {
+            }
+            return selfplay_lock_piece(board, opponent, rng);
+        default:
+            break;
+    }
+    if (gravity && !move(&board->piece, board->playfield, 0, 1, 0)) {
+        return selfplay_lock_piece(board, opponent, rng);
+    }
+    return 0;
+}
+
+static void env_observe(tetris_batch_s *batch, tetris_observation_s *observation) {
+    selfplay_board_s *board = NULL;
+    uint32_t *rows = observation->playfield;
+    int seat = 0;
+    int i = 0;
+
+    for (seat = 0; seat < batch->battles * 2; seat++) {
+        board = &batch->boards[seat];
+        for (i = 0; i < PLAYFIELD_H; i++) {
+            *rows++ = board->playfield[i];
+        }
+        observation->piece[seat] = board->piece_index;
+        observation->piece_x[seat] = board->piece.x;
+        observation->piece_y[seat] = board->piece.y;
+        observation->orientation[seat] = board->piece.orientation;
+        observation->next_piece[seat] = board->next_index;
+        observation->garbage[seat] = board->attack > 127 ? 127 : board->attack;
+    }
+}
+
+tetris_batch_s *tetris_batch_create(int battles, int gravity_period, uint64_t seed) {
+    tetris_batch_s *batch = NULL;
+    int i = 0;
+
+    if (battles < 1 || gravity_period < 1) {
+        return NULL;
+    }
+    batch = calloc(1, sizeof(tetris_batch_s));
+    if (!batch) {
+        return NULL;
+    }
+    batch->battles = battles;
+    batch->gravity_period = gravity_period;
+    batch->rng = calloc(battles, sizeof(uint64_t));
+    batch->boards = calloc(battles * 2, sizeof(selfplay_board_s));
+    if (!batch->rng || !batch->boards) {
+        tetris_batch_destroy(batch);
+        return NULL;
+    }
+    for (i = 0; i < battles; i++) {
+        batch->rng[i] = (seed ^ (0x9e3779b97f4a7c15ULL * (i + 1))) | 1;
+    }
+    for (i = 0; i < battles * 2; i++) { // stepping before the first reset plays fresh battles
+        selfplay_reset(&batch->boards[i], &batch->rng[i / 2]);
+    }
+    return batch;
+}
+
+void tetris_batch_destroy(tetris_batch_s *batch) {
+    if (batch) {
+        free(batch->rng);
+        free(batch->boards);
+        free(batch);
+    }
+}
+
+int tetris_batch_size(const tetris_batch_s *batch) {
+    return batch->battles;
+}
+
+void tetris_batch_reset(tetris_batch_s *batch, tetris_observation_s *observation) {
+    int i = 0;
+
+    for (i = 0; i < batch->battles * 2; i++) {
+        selfplay_reset(&batch->boards[i], &batch->rng[i / 2]);
+    }
+    batch->steps = 0;
+    env_observe(batch, observation);
+}
+
+void tetris_batch_step(tetris_batch_s *batch, const int8_t *actions,
+                       tetris_observation_s *observation, float *rewards, uint8_t *dones) {
+    selfplay_board_s *boards = NULL;
+    int gravity = (++batch->steps % batch->gravity_period) == 0;
+    int result1 = 0;
+    int result2 = 0;
+    int i = 0;
+
+    for (i = 0; i < batch->battles; i++) {
+        boards = &batch->boards[2 * i];
+        result1 = env_apply(&boards[0], &boards[1], &batch->rng[i], actions[2 * i], gravity);
+        result2 = env_apply(&boards[1], &boards[0], &batch->rng[i], actions[2 * i + 1], gravity);
+        rewards[2 * i] = result1;
+        rewards[2 * i + 1] = result2;
+        dones[i] = (result1 < 0 || result2 < 0);
+        if (dones[i]) {
+            selfplay_reset(&boards[0], &batch->rng[i]);
+            selfplay_reset(&boards[1], &batch->rng[i]);
+        }
+    }
+    env_observe(batch, observation);
+}
+
+#ifndef TETRIS_LIBRARY
+int run_env_benchmark(long seat_steps) {
+    tetris_batch_s *batch = NULL;
+    tetris_observation_s observation;
+    int8_t *actions = NULL;
+    float *rewards = NULL;
+    uint8_t *dones = NULL;
+    uint64_t rng = 0x2545f4914f6cdd1dULL;
+    long iterations = 0;
+    long start = 0;
+    double seconds = 0;
+    int battles = 0;
+    int seats = 0;
+    int i = 0;
+    long step = 0;
+
+    printf("%8s %8s %14s %14s %10s\n", "battles", "seats", "seat-steps/s", "batch-steps/s", "ns/seat");
+    for (battles = 1; battles <= 4096; battles *= 2) {
+        seats = battles * 2;
+        batch = tetris_batch_create(battles, 1, rng);
+        observation.playfield = malloc(seats * PLAYFIELD_H * sizeof(uint32_t));
+        observation.piece = malloc(seats);
+        observation.piece_x = malloc(seats);
+        observation.piece_y = malloc(seats);
+        observation.orientation = malloc(seats);
+        observation.next_piece = malloc(seats);
+        observation.garbage = malloc(seats);
+        actions = malloc(seats * 64); // a fixed pool of random actions, cycled
+        rewards = malloc(seats * sizeof(float));
+        dones = malloc(battles);
+        for (i = 0; i < seats * 64; i++) {
+            actions[i] = selfplay_random(&rng) % 6;
+        }
+        iterations = seat_steps / seats > 16 ? seat_steps / seats : 16;
+
+        tetris_batch_reset(batch, &observation);
+        start = get_current_micros();
+        for (step = 0; step < iterations; step++) {
+            tetris_batch_step(batch, actions + (step & 63) * seats, &observation, rewards, dones);
+        }
+        seconds = (get_current_micros() - start) / 1e6;
+        printf("%8d %8d %14.0f %14.0f %10.1f\n", battles, seats, iterations * seats / seconds,
+               iterations / seconds, seconds * 1e9 / (iterations * seats));
+
+        tetris_batch_destroy(batch);
+        free(observation.playfield);
+        free(observation.piece);
+        free(observation.piece_x);
+        free(observation.piece_y);
+        free(observation.orientation);
+        free(observation.next_piece);
+        free(observation.garbage);
+        free(actions);
+        free(rewards);
+        free(dones);
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Match server and loopback load generator.
+ *
+ * ./tetris --server pairs incoming TCP clients in arrival order and hands
+ * each 2p battle to one shard: a thread with its own epoll loop and timer
+ * wheel, one per core. A match never leaves its shard, so its state is
+ * touched by one thread only. The acceptor passes new matches through a
+ * per-shard SPSC queue and pokes the shard's eventfd.
+ *
+ * Rules are those of libtetris (env_apply), i.e. main's battle. Clients send
+ * player 1 keys as single bytes (d g r f a, q to leave); the server answers
+ * every input batch and every gravity tick with a server_msg_s for that
+ * seat, and with MSG_RESULT when the battle is over. Every few seconds the
+ * server reports live matches per core, gravity tick lateness and RSS growth
+ * per live match (socket buffers are kernel memory and not part of it).
+ * ./tetris --loadgen plays random bots against it over loopback.
+ */
+
+#ifndef TETRIS_LIBRARY
+#define SERVER_PORT 7777
+#define WHEEL_TICK 1000 // us per timer wheel slot
+#define WHEEL_SLOTS 4096 // power of two, spans about 4 s
+#define SHARD_QUEUE_SIZE 1024 // power of two
+#define MATCH_OUT_SIZE 4 // messages a slow client may have queued before it starts missing updates
+#define LATENCY_BUCKETS 1000 // 100 us wide, the last one takes everything slower
+#define SERVER_STATS_PERIOD 5000000
+
+#define MSG_STATE 1
+#define MSG_RESULT 2
+
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    long deadline;
+} wheel_timer_s;
+
+typedef struct {
+    wheel_timer_s *slots[WHEEL_SLOTS];
+    long tick; // last slot processed, in WHEEL_TICK units
+} timer_wheel_s;
+
+typedef struct {
+    uint8_t type;
+    uint8_t result; // MSG_RESULT: 1 won, 0 lost
+    uint8_t piece;
+    uint8_t orientation;
+    int8_t x;
+    int8_t y;
+    uint8_t next_piece;
+    uint8_t garbage;
+    uint32_t seq;
+    uint32_t playfield[PLAYFIELD_H];
+} server_msg_s;
+
+typedef struct match match_s;
+
+typedef struct {
+    match_s *match;
+    int seat;
+    int fd;
+    int out_len;
+    char out[MATCH_OUT_SIZE * sizeof(server_msg_s)]; // unsent tail, flushed on EPOLLOUT
+} match_conn_s;
+
+struct match {
+    wheel_timer_s timer; // first member, so expired timers cast back to their match
+    selfplay_board_s boards[2];
+    match_conn_s conns[2];
+    uint64_t rng;
+    uint32_t seq;
+    int over;
+};
+
+typedef struct {
+    int epfd;
+    int wakefd;
+    pthread_t thread;
+    long gravity;
+    timer_wheel_s wheel;
+    _Alignas(64) atomic_size_t head; // advanced by the shard
+    _Alignas(64) atomic_size_t tail; // advanced by the acceptor
+    match_s *queue[SHARD_QUEUE_SIZE];
+    atomic_long active;
+    atomic_long finished;
+    atomic_long late[LATENCY_BUCKETS]; // gravity tick lateness
+} shard_s;
+
+static void wheel_add(timer_wheel_s *wheel, wheel_timer_s *timer, long deadline) {
+    long tick = deadline / WHEEL_TICK;
+
+    if (tick <= wheel->tick) {
+        tick = wheel->tick + 1;
+    }
+    timer->deadline = deadline;
+    timer->next = wheel->slots[tick & (WHEEL_SLOTS - 1)];
+    wheel->slots[tick & (WHEEL_SLOTS - 1)] = timer;
+}
+
+// Unlinks every timer due by now and returns them as a list.
+static wheel_timer_s *wheel_expire(timer_wheel_s *wheel, long now) {
+    wheel_timer_s *due = NULL;
+    wheel_timer_s *keep = NULL;
+    wheel_timer_s *timer = NULL;
+    wheel_timer_s *next = NULL;
+    long until = now / WHEEL_TICK;
+    long tick = 0;
+
+    if (until - wheel->tick > WHEEL_SLOTS) { // slept through a whole lap, every slot gets visited anyway
+        wheel->tick = until - WHEEL_SLOTS;
+    }
+    for (tick = wheel->tick + 1; tick <= until; tick++) {
+        keep = NULL;
+        for (timer = wheel->slots[tick & (WHEEL_SLOTS - 1)]; timer; timer = next) {
+            next = timer->next;
+            if (timer->deadline / WHEEL_TICK <= until) {
+                timer->next = due;
+                due = timer;
+            } else { // due on a later lap
+                timer->next = keep;
+                keep = timer;
+            }
+        }
+        wheel->slots[tick & (WHEEL_SLOTS - 1)] = keep;
+    }
+    wheel->tick = until;
+    return due;
+}
+
+static void latency_record(atomic_long *buckets, long us) {
+    long i = us > 0 ? us / 100 : 0; // the wheel fires anywhere within a timer's slot
+
+    atomic_fetch_add_explicit(&buckets[i < LATENCY_BUCKETS ? i : LATENCY_BUCKETS - 1], 1, memory_order_relaxed);
+}
+
+static double latency_percentile(long *buckets, double p) { // upper edge of the bucket, in ms
+    long total = 0;
+    long seen = 0;
+    int i = 0;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        total += buckets[i];
+    }
+    for (i = 0; i < LATENCY_BUCKETS && total; i++) {
+        seen += buckets[i];
+        if (seen >= p * total) {
+            return (i + 1) / 10.0;
+        }
+    }
+    return 0;
+}
+
+static void raise_fd_limit() {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void conn_watch_out(shard_s *shard, match_conn_s *conn, int on) {
+    struct epoll_event event;
+
+    event.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = conn;
+    epoll_ctl(shard->epfd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+// Messages go out whole or not at all, so the client's fixed-size framing survives a full socket.
+static void conn_send(shard_s *shard, match_conn_s *conn, const void *data, int len) {
+    int sent = 0;
+
+    if (conn->out_len == 0) {
+        sent = send(conn->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) { // EAGAIN, or an error the next read will report
+            sent = 0;
+        }
+        if (sent == len) {
+            return;
+        }
+    } else if (conn->out_len + len > (int)sizeof(conn->out)) { // backlog full: this update is missed
+        return;
+    }
+    memcpy(conn->out + conn->out_len, (const char *)data + sent, len - sent);
+    if (conn->out_len == 0) {
+        conn_watch_out(shard, conn, 1);
+    }
+    conn->out_len += len - sent;
+}
+
+static void conn_flush(shard_s *shard, match_conn_s *conn) {
+    int sent = send(conn->fd, conn->out, conn->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (sent <= 0) {
+        return;
+    }
+    memmove(conn->out, conn->out + sent, conn->out_len - sent);
+    conn->out_len -= sent;
+    if (conn->out_len == 0) {
+        conn_watch_out(shard, conn, 0);
+    }
+}
+
+static void match_send(shard_s *shard, match_s *match, int seat, int type, int result) {
+    selfplay_board_s *board = &match->boards[seat];
+    server_msg_s msg;
+    int i = 0;
+
+    msg.type = type;
+    msg.result = result;
+    msg.piece = board->piece_index;
+    msg.orientation = board->piece.orientation;
+    msg.x = board->piece.x;
+    msg.y = board->piece.y;
+    msg.next_piece = board->next_index;
+    msg.garbage = board->attack > 255 ? 255 : board->attack;
+    msg.seq = match->seq++;
+    for (i = 0; i < PLAYFIELD_H; i++) {
+        msg.playfield[i] = board->playfield[i];
+    }
+    conn_send(shard, &match->conns[seat], &msg, sizeof(msg));
+}
+
+static void match_end(shard_s *shard, match_s *match, int winner) {
+    char buf[256];
+    int seat = 0;
+
+    if (match->over) {
+        return;
+    }
+    match->over = 1; // freed when its timer next fires
+    for (seat = 0; seat < 2; seat++) {
+        match_send(shard, match, seat, MSG_RESULT, seat == winner);
+        if (match->conns[seat].out_len) { // last chance for the backlog, a client still behind sees only the close
+            conn_flush(shard, &match->conns[seat]);
+        }
+        while (read(match->conns[seat].fd, buf, sizeof(buf)) > 0) { // unread input would turn close into a reset that eats the result
+        }
+        close(match->conns[seat].fd);
+    }
+    atomic_fetch_sub_explicit(&shard->active, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->finished, 1, memory_order_relaxed);
+}
+
+static void match_read(shard_s *shard, match_conn_s *conn) {
+    match_s *match = conn->match;
+    char buf[64];
+    int action = 0;
+    int n = 0;
+    int i = 0;
+
+    if (match->over) {
+        return;
+    }
+    n = read(conn->fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        match_end(shard, match, conn->seat ^ 1);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        switch (buf[i]) {
+            case 'd':
+                action = TETRIS_ACTION_LEFT;
+                break;
+            case 'g':
+                action = TETRIS_ACTION_RIGHT;
+                break;
+            case 'r':
+                action = TETRIS_ACTION_ROTATE;
+                break;
+            case 'f':
+                action = TETRIS_ACTION_DOWN;
+                break;
+            case 'a':
+                action = TETRIS_ACTION_DROP;
+                break;
+            case 'q':
+                match_end(shard, match, conn->seat ^ 1);
+                return;
+            default:
+                continue;
+        }
+        if (env_apply(&match->boards[conn->seat], &match->boards[conn->seat ^ 1], &match->rng, action, 0) < 0) {
+            match_end(shard, match, conn->seat ^ 1);
+            return;
+        }
+    }
+    match_send(shard, match, conn->seat, MSG_STATE, 0);
+}
+
+static void match_gravity(shard_s *shard, match_s *match, long now) {
+    int seat = 0;
+
+    for (seat = 0; seat < 2; seat++) {
+        if (env_apply(&match->boards[seat], &match->boards[seat ^ 1], &match->rng, TETRIS_ACTION_NONE, 1) < 0) {
+            match_end(shard, match, seat ^ 1);
+            break;
+        }
+    }
+    if (!match->over) {
+        match_send(shard, match, 0, MSG_STATE, 0);
+        match_send(shard, match, 1, MSG_STATE, 0);
+    }
+    if (match->timer.deadline + shard->gravity > now) {
+        wheel_add(&shard->wheel, &match->timer, match->timer.deadline + shard->gravity);
+    } else { // fell a whole period behind, don't burst to catch up
+        wheel_add(&shard->wheel, &match->timer, now + shard->gravity);
+    }
+}
+
+static void shard_adopt(shard_s *shard, long now) {
+    size_t head = atomic_load_explicit(&shard->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&shard->tail, memory_order_acquire);
+    struct epoll_event event;
+    match_s *match = NULL;
+    int seat = 0;
+
+    for (; head != tail; head++) {
+        match = shard->queue[head & (SHARD_QUEUE_SIZE - 1)];
+        for (seat = 0; seat < 2; seat++) {
+            event.events = EPOLLIN;
+            event.data.ptr = &match->conns[seat];
+            epoll_ctl(shard->epfd, EPOLL_CTL_ADD, match->conns[seat].fd, &event);
+            match_send(shard, match, seat, MSG_STATE, 0);
+        }
+        wheel_add(&shard->wheel, &match->timer, now + shard->gravity);
+        atomic_fetch_add_explicit(&shard->active, 1, memory_order_relaxed);
+    }
+    atomic_store_explicit(&shard->head, head, memory_order_release);
+}
+
+static void *shard_thread(void *arg) {
+    shard_s *shard = arg;
+    struct epoll_event events[256];
+    wheel_timer_s *timer = NULL;
+    wheel_timer_s *next = NULL;
+    match_s *match = NULL;
+    match_conn_s *conn = NULL;
+    uint64_t wake = 0;
+    long now = get_current_micros();
+    int n = 0;
+    int i = 0;
+
+    shard->wheel.tick = now / WHEEL_TICK;
+    while (1) {
+        n = epoll_wait(shard->epfd, events, sizeof(events) / sizeof(events[0]), 1);
+        now = get_current_micros();
+        for (i = 0; i < n; i++) {
+            if (!events[i].data.ptr) {
+                if (read(shard->wakefd, &wake, sizeof(wake)) == sizeof(wake)) {
+                    shard_adopt(shard, now);
+                }
+            } else {
+                conn = events[i].data.ptr;
+                if ((events[i].events & EPOLLOUT) && !conn->match->over) {
+                    conn_flush(shard, conn);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    match_read(shard, conn);
+                }
+            }
+        }
+        for (timer = wheel_expire(&shard->wheel, now); timer; timer = next) {
+            next = timer->next;
+            match = (match_s *)timer;
+            if (match->over) {
+                free(match);
+                continue;
+            }
+            latency_record(shard->late, now - timer->deadline);
+            match_gravity(shard, match, now);
+        }
+    }
+    return NULL;
+}
+
+static long resident_bytes() {
+    long pages = 0;
+    long resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if (!statm) {
+        return 0;
+    }
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Whether the queued client is still connected. It has no match yet, so anything it sent is dropped.
+static int waiting_alive(int fd) {
+    char buf[64];
+    int n = 0;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    }
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int run_server(int port, int shard_count, long gravity) {
+    shard_s *shards = NULL;
+    shard_s *shard = NULL;
+    match_s *match = NULL;
+    struct sockaddr_in addr;
+    struct pollfd pfd;
+    struct epoll_event event;
+    long late[LATENCY_BUCKETS];
+    long last_finished = 0;
+    long finished = 0;
+    long active = 0;
+    long baseline = 0;
+    long last_report = 0;
+    long now = 0;
+    uint64_t one = 1;
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int waiting = -1;
+    int next_shard = 0;
+    int fd = -1;
+    int on = 1;
+    int i = 0;
+    int j = 0;
+
+    if (shard_count < 1 || gravity < WHEEL_TICK || gravity >= (long)WHEEL_SLOTS * WHEEL_TICK) {
+        fprintf(stderr, "usage: tetris --server [PORT] [SHARDS] [GRAVITY_MS < %d]\n", WHEEL_SLOTS * WHEEL_TICK / 1000);
+        return 1;
+    }
+    raise_fd_limit();
+    signal(SIGPIPE, SIG_IGN);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) || listen(listener, 4096)) {
+        perror("listen");
+        return 1;
+    }
+
+    if (posix_memalign((void **)&shards, 64, shard_count * sizeof(shard_s))) {
+        perror("posix_memalign");
+        return 1;
+    }
+    memset(shards, 0, shard_count * sizeof(shard_s));
+    for (i = 0; i < shard_count; i++) {
+        shards[i].gravity = gravity;
+        shards[i].epfd = epoll_create1(0);
+        shards[i].wakefd = eventfd(0, EFD_NONBLOCK);
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(shards[i].epfd, EPOLL_CTL_ADD, shards[i].wakefd, &event);
+        pthread_create(&shards[i].thread, NULL, shard_thread, &shards[i]);
+    }
+    baseline = resident_bytes();
+    last_report = get_current_micros();
+    fprintf(stderr, "listening on port %d, %d shard(s), gravity %ld ms, %zu bytes per match_s\n",
+            port, shard_count, gravity / 1000, sizeof(match_s));
+
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK); // accept until the backlog is empty
+    pfd.fd = listener;
+    pfd.events = POLLIN;
+    while (1) {
+        if (poll(&pfd, 1, 1000) > 0) {
+            while ((fd = accept(listener, NULL, NULL)) >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                if (waiting >= 0 && !waiting_alive(waiting)) { // left while queued, don't hand fd a free win
+                    close(waiting);
+                    waiting = -1;
+                }
+                if (waiting < 0) { // matchmaking: first come, first paired
+                    waiting = fd;
+                    continue;
+                }
+                match = calloc(1, sizeof(match_s));
+                match->rng = ((uint64_t)get_current_micros() << 20 ^ fd) | 1;
+                selfplay_reset(&match->boards[0], &match->rng);
+                selfplay_reset(&match->boards[1], &match->rng);
+                match->conns[0].match = match;
+                match->conns[0].fd = waiting;
+                match->conns[1].match = match;
+                match->conns[1].seat = 1;
+                match->conns[1].fd = fd;
+                waiting = -1;
+
+                shard = &shards[next_shard++ % shard_count];
+                while (atomic_load_explicit(&shard->tail, memory_order_relaxed) -
+                       atomic_load_explicit(&shard->head, memory_order_acquire) == SHARD_QUEUE_SIZE) {
+                    sched_yield();
+                }
+                shard->queue[atomic_load_explicit(&shard->tail, memory_order_relaxed) & (SHARD_QUEUE_SIZE - 1)] = match;
+                atomic_fetch_add_explicit(&shard->tail, 1, memory_order_release);
+                if (write(shard->wakefd, &one, sizeof(one)) != sizeof(one)) {
+                    perror("eventfd");
+                }
+            }
+        }
+
+        now = get_current_micros();
+        if (now - last_report < SERVER_STATS_PERIOD) {
+            continue;
+        }
+        active = 0;
+        finished = 0;
+        memset(late, 0, sizeof(late));
+        for (i = 0; i < shard_count; i++) {
+            active += atomic_load_explicit(&shards[i].active, memory_order_relaxed);
+            finished += atomic_load_explicit(&shards[i].finished, memory_order_relaxed);
+            for (j = 0; j < LATENCY_BUCKETS; j++) {
+                late[j] += atomic_exchange_explicit(&shards[i].late[j], 0, memory_order_relaxed);
+            }
+        }
+        fprintf(stderr, "%ld matches (%.1f per core), %.1f finished/s, tick lateness p50 %.1f ms p99 %.1f ms p999 %.1f ms, %ld B RSS per match\n",
+                active, (double)active / shard_count, (finished - last_finished) * 1e6 / (now - last_report),
+                latency_percentile(late, 0.50), latency_percentile(late, 0.99), latency_percentile(late, 0.999),
+                active ? (resident_bytes() - baseline) / active : 0);
+        last_finished = finished;
+        last_report = now;
+    }
+    return 0;
+}
+
+typedef struct {
+    wheel_timer_s timer; // next action, first member
+    int fd;
+    int fill;
+    server_msg_s msg;
+    long sent_at; // action waiting for its state reply
+    uint64_t rng;
+} bot_s;
+
+typedef struct {
+    pthread_t thread;
+    struct sockaddr_in addr;
+    bot_s *bots;
+    int bot_count;
+    long interval;
+    long deadline;
+    long actions;
+    long states;
+    long results;
+    long failures;
+    long rtt[LATENCY_BUCKETS];
+} loadgen_s;
+
+static int bot_connect(loadgen_s *gen, bot_s *bot, int epfd) {
+    struct epoll_event event;
+    int on = 1;
+
+    bot->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (bot->fd < 0 || connect(bot->fd, (struct sockaddr *)&gen->addr, sizeof(gen->addr))) {
+        if (bot->fd >= 0) {
+            close(bot->fd);
+        }
+        bot->fd = -1;
+        gen->failures++;
+        return -1;
+    }
+    setsockopt(bot->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(bot->fd, F_SETFL, fcntl(bot->fd, F_GETFL) | O_NONBLOCK);
+    bot->fill = 0;
+    bot->sent_at = 0;
+    event.events = EPOLLIN;
+    event.data.ptr = bot;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, bot->fd, &event);
+    return 0;
+}
+
+static void *loadgen_thread(void *arg) {
+    loadgen_s *gen = arg;
+    static const char actions[] = "ddddgggggrrrrrffa"; // mostly steering, an occasional drop
+    struct epoll_event events[256];
+    timer_wheel_s *wheel = calloc(1, sizeof(timer_wheel_s));
+    wheel_timer_s *timer = NULL;
+    wheel_timer_s *next = NULL;
+    bot_s *bot = NULL;
+    long now = get_current_micros();
+    char key = 0;
+    int epfd = epoll_create1(0);
+    int n = 0;
+    int i = 0;
+
+    wheel->tick = now / WHEEL_TICK;
+    for (i = 0; i < gen->bot_count; i++) {
+        bot = &gen->bots[i];
+        bot->rng = (0x9e3779b97f4a7c15ULL * (i + 1)) ^ (uint64_t)(uintptr_t)gen;
+        bot_connect(gen, bot, epfd);
+        wheel_add(wheel, &bot->timer, now + selfplay_random(&bot->rng) % gen->interval);
+    }
+    while ((now = get_current_micros()) < gen->deadline) {
+        n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), 1);
+        now = get_current_micros();
+        for (i = 0; i < n; i++) {
+            bot = events[i].data.ptr;
+            while (bot->fd >= 0) {
+                int got = read(bot->fd, (char *)&bot->msg + bot->fill, sizeof(bot->msg) - bot->fill);
+
+                if (got <= 0) {
+                    if (got == 0 || (errno != EAGAIN && errno != EINTR)) { // opponent left, or the server went away
+                        gen->results++;
+                        close(bot->fd);
+                        bot->fd = -1;
+                    }
+                    break;
+                }
+                bot->fill += got;
+                if (bot->fill < (int)sizeof(bot->msg)) {
+                    continue;
+                }
+                bot->fill = 0;
+                if (bot->msg.type == MSG_RESULT) {
+                    gen->results++;
+                    close(bot->fd);
+                    bot->fd = -1;
+                    break;
+                }
+                gen->states++;
+                if (bot->sent_at) {
+                    gen->rtt[(now - bot->sent_at) / 100 < LATENCY_BUCKETS ? (now - bot->sent_at) / 100 : LATENCY_BUCKETS - 1]++;
+                    bot->sent_at = 0;
+                }
+            }
+        }
+        for (timer = wheel_expire(wheel, now); timer; timer = next) {
+            next = timer->next;
+            bot = (bot_s *)timer;
+            if (bot->fd < 0 && bot_connect(gen, bot, epfd) < 0) { // back in the matchmaking queue
+                wheel_add(wheel, &bot->timer, now + gen->interval);
+                continue;
+            }
+            key = actions[selfplay_random(&bot->rng) % (sizeof(actions) - 1)];
+            if (send(bot->fd, &key, 1, MSG_DONTWAIT | MSG_NOSIGNAL) == 1) {
+                gen->actions++;
+                if (!bot->sent_at) {
+                    bot->sent_at = now;
+                }
+            }
+            wheel_add(wheel, &bot->timer, now + gen->interval / 2 + selfplay_random(&bot->rng) % gen->interval);
+        }
+    }
+    for (i = 0; i < gen->bot_count; i++) {
+        if (gen->bots[i].fd >= 0) {
+            close(gen->bots[i].fd);
+        }
+    }
+    close(epfd);
+    free(wheel);
+    return NULL;
+}
+
+int run_loadgen(const char *host, int port, int clients, long seconds, long actions_per_second, int threads) {
+    loadgen_s *gens = NULL;
+    bot_s *bots = NULL;
+    long rtt[LATENCY_BUCKETS] = {};
+    long actions = 0;
+    long states = 0;
+    long results = 0;
+    long failures = 0;
+    long start = 0;
+    double elapsed = 0;
+    int i = 0;
+    int j = 0;
+
+    if (clients < 2 || seconds < 1 || actions_per_second < 1 || actions_per_second > 1000000 || threads < 1) {
+        fprintf(stderr, "usage: tetris --loadgen [HOST] [PORT] [CLIENTS] [SECONDS] [ACTIONS_PER_S]\n");
+        return 1;
+    }
+    raise_fd_limit();
+    signal(SIGPIPE, SIG_IGN);
+    gens = calloc(threads, sizeof(loadgen_s));
+    bots = calloc(clients, sizeof(bot_s));
+    start = get_current_micros();
+    for (i = 0; i < threads; i++) {
+        gens[i].addr.sin_family = AF_INET;
+        gens[i].addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, host, &gens[i].addr.sin_addr) != 1) {
+            fprintf(stderr, "%s: not an IPv4 address\n", host);
+            return 1;
+        }
+        gens[i].bots = bots + (long)clients * i / threads;
+        gens[i].bot_count = (long)clients * (i + 1) / threads - (long)clients * i / threads;
+        gens[i].interval = 1000000 / actions_per_second;
+        gens[i].deadline = start + seconds * 1000000;
+        pthread_create(&gens[i].thread, NULL, loadgen_thread, &gens[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(gens[i].thread, NULL);
+        actions += gens[i].actions;
+        states += gens[i].states;
+        results += gens[i].results;
+        failures += gens[i].failures;
+        for (j = 0; j < LATENCY_BUCKETS; j++) {
+            rtt[j] += gens[i].rtt[j];
+        }
+    }
+    elapsed = (get_current_micros() - start) / 1e6;
+
+    printf("%d bots on %d thread(s) for %.1f s\n", clients, threads, elapsed);
+    printf("matches finished:   %ld (%.1f/s)\n", results / 2, results / 2 / elapsed); // both seats see the end
+    printf("actions sent:       %.0f/s\n", actions / elapsed);
+    printf("states received:    %.0f/s\n", states / elapsed);
+    printf("action->state p50:  %.1f ms, p99 %.1f ms, p999 %.1f ms\n",
+           latency_percentile(rtt, 0.50), latency_percentile(rtt, 0.99), latency_percentile(rtt, 0.999));
+    printf("connect failures:   %ld\n", failures);
+    free(gens);
+    free(bots);
+    return 0;
+}
+#endif
+
+#ifndef TETRIS_LIBRARY
+int main(int argc, char **argv) {
+    char c = 0;
+    char key[] = {0, 0, 0};
+    tcflag_t c_lflag_orig = 0;
+    int help_visible = 1;
+    int next_visible = 1;
+    int color_visible = 1;
+    frame_s frame;
+    int frame_pending = 0; // last frame was rejected by the full ring
+    int topped_out = 0;
+    tetris_piece_s next_piece, next_piece1;// 2p next_piece1
+    tetris_piece_s current_piece, current_piece1; // 2p current_piecee1
+    int playfield[PLAYFIELD_H] = {};
+	int playfield1[PLAYFIELD_H] = {}; // 2p playfield ߰
+    int i = 0;
+    long last_down_time = 0;
+    long now = 0;
+    long delay = 0;
+    int event = 0;
+    int player = 0;
+    double das_ms = 0;
+    double arr_ms = 0;
+
+    if (argc > 2 && strcmp(argv[1], "--dataset") == 0) {
+        return run_dataset(argv[2], argc > 3 ? atol(argv[3]) : 10000000, argc > 4 ? atoi(argv[4]) : sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-env") == 0) {
+        return run_env_benchmark(argc > 2 ? atol(argv[2]) : 4000000);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-render") == 0) {
+        return run_render_benchmark();
+    }
+    if (argc > 1 && strcmp(argv[1], "--test-das") == 0) {
+        return run_das_test();
+    }
+    if (argc > 1 && strcmp(argv[1], "--server") == 0) {
+        return run_server(argc > 2 ? atoi(argv[2]) : SERVER_PORT, argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN),
+                          (argc > 4 ? atol(argv[4]) : DELAY * 1000) * 1000);
+    }
+    if (argc > 1 && strcmp(argv[1], "--loadgen") == 0) {
+        return run_loadgen(argc > 2 ? argv[2] : "127.0.0.1", argc > 3 ? atoi(argv[3]) : SERVER_PORT, argc > 4 ? atoi(argv[4]) : 2000,
+                           argc > 5 ? atol(argv[5]) : 30, argc > 6 ? atol(argv[6]) : 5, sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--das") == 0 && i + 1 < argc &&
+            sscanf(argv[++i], "%d:%lf:%lf", &player, &das_ms, &arr_ms) == 3 && (player == 1 || player == 2) &&
+            das_ms >= 0 && das_ms <= DAS_LIMIT_MS && arr_ms >= 0 && arr_ms <= DAS_LIMIT_MS) { // NaN fails both bounds
+            das[player - 1].das = das_ms * 1000;
+            das[player - 1].arr = arr_ms * 1000;
+#ifdef TETRIS_TRACE
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_start(argv[++i]);
+#endif
+        } else {
+            fprintf(stderr, "usage: %s [--das PLAYER:DAS_MS:ARR_MS]...%s\n", argv[0], TRACE_USAGE);
+            fprintf(stderr, "       PLAYER is 1 or 2, DAS_MS and ARR_MS between 0 and %d\n", DAS_LIMIT_MS);
+            return 1;
+        }
+    }
+    tcgetattr(STDIN_FILENO, &terminal_conf);
+    c_lflag_orig = terminal_conf.c_lflag;
+    terminal_conf.c_lflag &= ~(ICANON | ECHO);
+    tcsetattr(STDIN_FILENO, TCSANOW, &terminal_conf);
+    terminal_conf.c_lflag = c_lflag_orig;
+
+    last_down_time = get_current_micros();
+    srandom(time(NULL));
+    for (i = 0; i < PLAYFIELD_H; i++) {
+        playfield[i] = 0;
+    }
+    next_piece = get_next_piece();
+    current_piece = get_current_piece(next_piece);
+    next_piece = get_next_piece();
+
+	next_piece1 = get_next_piece1();//2p ʱ block 
+	current_piece1 = get_current_piece1(next_piece1);//2p ʱ block ǥ
+	next_piece1 = get_next_piece1();//2p  block 
+
+    probe_terminal();
+    TRACE_THREAD("game");
+    render_start();
+    while(1) {
+        now = get_current_micros();
+        // judged on the spawn itself, before an auto-shift can slide it clear
+        topped_out = !position_ok(current_piece, playfield, NULL) || !position_ok(current_piece1, playfield1, NULL);
+        if (!topped_out) {
+            das_update(&das[0], now, &current_piece, playfield);
+            das_update(&das[1], now, &current_piece1, playfield1);
+        }
+        memcpy(frame.playfield[0], playfield, sizeof(playfield));
+        memcpy(frame.playfield[1], playfield1, sizeof(playfield1));
+        frame.current[0] = current_piece;
+        frame.current[1] = current_piece1;
+        frame.next[0] = next_piece;
+        frame.next[1] = next_piece1;
+        frame.help_visible = help_visible;
+        frame.next_visible = next_visible;
+        frame.use_color = color_visible;
+        frame_pending = !frame_publish(&frame);
+        if (topped_out) {
+            while (frame_pending) { // the final board must reach the screen before "Game over!"
+                usleep(FRAME_RETRY_DELAY);
+                frame_pending = !frame_publish(&frame);
+            }
+            cmd_quit();
+        }
+        delay = last_down_time + tetris_delay - now;
+        if (das_deadline(&das[0]) - now < delay) {
+            delay = das_deadline(&das[0]) - now;
+        }
+        if (das_deadline(&das[1]) - now < delay) {
+            delay = das_deadline(&das[1]) - now;
+        }
+        if (frame_pending && delay > FRAME_RETRY_DELAY) { // ring was full: republish soon
+            delay = FRAME_RETRY_DELAY;
+        }
+        c = get_input(delay, &event);
+        now = get_current_micros();
+        if (c == 0 && now < last_down_time + tetris_delay) { // woke up for an auto-shift or a retry, not gravity
+            continue;
+        }
+        key[2] = key[1];
+        key[1] = key[0];
+        if (key[2] == ESC && key[1] == '[') {
+            key[0] = c;
+        } else {
+            key[0] = tolower(c);
+        }
+        if (event == KEY_RELEASE) { // only auto-shift cares about releases
+            if (key[0] == 'g' || key[0] == 'd') {
+                das_key(&das[0], key[0] == 'g' ? 1 : -1, event, now, &current_piece, playfield);
+            }
+            if (key[0] == '6' || key[0] == '4') {
+                das_key(&das[1], key[0] == '6' ? 1 : -1, event, now, &current_piece1, playfield1);
+            }
+            continue;
+        }
+        switch(key[0]) {
+            case 3:
+            case 'q':
+                cmd_quit();
+                break;
+            //case 'C'://
+            case 'g':
+                das_key(&das[0], 1, event, now, &current_piece, playfield);
+                break;
+            //case 'D'://
+            case 'd':
+                das_key(&das[0], -1, event, now, &current_piece, playfield);
+                break;
+            //case 'A'://
+            case 'r':
+                cmd_rotate(&current_piece, playfield);
+                break;
+            case 'f':
+                last_down_time = get_current_micros();
+                if (!cmd_down(&current_piece, playfield, playfield1)) { // block ٴڿ ϸ
+					while (attack2 > 0) { // player 2  īƮ 
+						push_garbage_line(playfield, rand() % 8);
+						attack2--;
+					}
+
+
+                    current_piece = get_current_piece(next_piece);
+                    next_piece = get_next_piece();
+                }
+                break;
+            case 'a':
+				cmd_drop(&current_piece, playfield, playfield1);
+				while (attack2 > 0) {
+					push_garbage_line(playfield, rand() % 8);
+					attack2--;
+				}
+				
+                current_piece = get_current_piece(next_piece);
+                next_piece = get_next_piece();
+                break;
+				//
+				//case 'C'://
+			case '6':
+				das_key(&das[1], 1, event, now, &current_piece1, playfield1);//߰
+				break;
+				//case 'D'://
+			case '4':
+				das_key(&das[1], -1, event, now, &current_piece1, playfield1);//߰
+				break;
+				//case 'A'://
+			case '8':
+				cmd_rotate(&current_piece1, playfield1);//߰
+				break;
+			case '5':
+				last_down_time = get_current_micros();
+				if (!cmd_down1(&current_piece1, playfield1,playfield)) {
+					while (attack1 > 0) {
+						push_garbage_line(playfield1, rand() % 8);
+						attack1--;
+					}
+					
+
+					current_piece1 = get_current_piece1(next_piece1);
+					next_piece1 = get_next_piece1();
+
+				}
+				break;
+			case 'p':
+				cmd_drop1(&current_piece1, playfield1, playfield);
+				while (attack1 > 0) {
+					push_garbage_line(playfield1, rand() % 8);
 					attack1--;
 				}
-				draw_playfield1(playfield1);
 
-				current_piece1 = get_current_piece1(next_piece1, playfield1);
-				next_piece1 = get_next_piece1(next_visible);
+				current_piece1 = get_current_piece1(next_piece1);
+				next_piece1 = get_next_piece1();
 
 				break;
 				
@@ -783,53 +2978,36 @@ int main() {
 				last_down_time = get_current_micros();
 				if (!cmd_down(&current_piece, playfield,playfield1)) {
 					while (attack2 > 0) {
-						for (i = 0; i < 19; i++)
-							*(playfield + i) = *(playfield + i + 1);
-						*(playfield + 19) = 7;
-						for (i = 0; i < 9; i++) {
-							*(playfield + 19) = (*(playfield + 19) << 3) + 7;
-						}
-						*(playfield + 19) = *(playfield + 19) ^ (7 << 3 * ((rand() % 8)));//(rand() % 8) + 1
+						push_garbage_line(playfield, rand() % 8);
 						attack2--;
 					}
 
-					draw_playfield(playfield);
-					current_piece = get_current_piece(next_piece, playfield);
-					next_piece = get_next_piece(next_visible);
+					current_piece = get_current_piece(next_piece);
+					next_piece = get_next_piece();
 				}
 				if (!cmd_down1(&current_piece1, playfield1,playfield)) {
 					while (attack1 > 0) {
-						for (i = 0; i < 19; i++)
-							*(playfield1 + i) = *(playfield1 + i + 1);
-						*(playfield1 + 19) = 7;
-						for (i = 0; i < 9; i++) {
-							*(playfield1 + 19) = (*(playfield1 + 19) << 3) + 7;
-						}
-						*(playfield1 + 19) = *(playfield1 + 19) ^ (7 << 3 * ((rand() % 8)));//(rand() % 8) + 1
+						push_garbage_line(playfield1, rand() % 8);
 						attack1--;
 					}
 
-					draw_playfield1(playfield1);
-					current_piece1 = get_current_piece1(next_piece1, playfield1);
-					next_piece1 = get_next_piece1(next_visible);
+					current_piece1 = get_current_piece1(next_piece1);
+					next_piece1 = get_next_piece1();
 				}
 				break;
 
             case 'h':
                 help_visible ^= 1;
-                draw_help(help_visible);
                 break;
             case 'n':
                 next_visible ^= 1;
-                draw_piece(next_piece, next_visible);
                 break;
             case 'c':
-                use_color ^= 1;
-                redraw_screen(help_visible, next_piece, next_visible, current_piece, playfield);
+                color_visible ^= 1;
                 break;
             default:
                 break;
         }
-        fflush(stdout);
     }
 }
+#endif
@@ -0,0 +1,58 @@
+/*
+ * C API of libtetris.so: batches of headless 2p battles stepped in lockstep.
+ *
+ * Compilation: gcc -O2 -shared -fPIC -fvisibility=hidden -DTETRIS_LIBRARY -o libtetris.so tetris.c -pthread
+ *
+ * A batch of N battles has 2N seats; seat 2i is player 1 and seat 2i+1 is
+ * player 2 of battle i. Every per-seat buffer below is a contiguous array
+ * indexed by seat, owned by the caller and reused across steps.
+ */
+
+#ifndef TETRIS_H
+#define TETRIS_H
+
+#include <stdint.h>
+
+#define TETRIS_API __attribute__((visibility("default")))
+
+#define TETRIS_PLAYFIELD_W 10
+#define TETRIS_PLAYFIELD_H 20
+
+#define TETRIS_ACTION_NONE 0
+#define TETRIS_ACTION_LEFT 1
+#define TETRIS_ACTION_RIGHT 2
+#define TETRIS_ACTION_ROTATE 3
+#define TETRIS_ACTION_DOWN 4
+#define TETRIS_ACTION_DROP 5
+
+typedef struct tetris_batch tetris_batch_s;
+
+typedef struct {
+    uint32_t *playfield;  // [2N][TETRIS_PLAYFIELD_H] rows, 3 bits per cell, current piece not included
+    int8_t *piece;        // [2N] piece index 0-6
+    int8_t *piece_x;      // [2N]
+    int8_t *piece_y;      // [2N]
+    int8_t *orientation;  // [2N]
+    int8_t *next_piece;   // [2N] preview piece index
+    int8_t *garbage;      // [2N] garbage lines waiting to rise on this seat
+} tetris_observation_s;
+
+// gravity_period: steps per automatic one-row fall (1 = every step). Battles
+// start dealt, so tetris_batch_step may be called before tetris_batch_reset.
+TETRIS_API tetris_batch_s *tetris_batch_create(int battles, int gravity_period, uint64_t seed);
+TETRIS_API void tetris_batch_destroy(tetris_batch_s *batch);
+TETRIS_API int tetris_batch_size(const tetris_batch_s *batch);
+
+// Starts every battle over and writes the first observation.
+TETRIS_API void tetris_batch_reset(tetris_batch_s *batch, tetris_observation_s *observation);
+
+/*
+ * Applies actions[2N], then gravity, to every battle. rewards[2N] receives
+ * the lines each seat cleared (-1 for the seat that topped out) and
+ * dones[N] is set for battles that ended; those are restarted before the
+ * observation is written.
+ */
+TETRIS_API void tetris_batch_step(tetris_batch_s *batch, const int8_t *actions,
+                                  tetris_observation_s *observation, float *rewards, uint8_t *dones);
+
+#endif
@@ -0,0 +1,330 @@
+/*
+ * Keypress-to-screen latency harness for tetris.c.
+ *
+ * Compilation: gcc -O2 -o tetris_latency tetris_latency.c -lutil
+ *
+ * Usage: ./tetris_latency [-r RATE] [-n INPUTS] [-k KEYS] [GAME]
+ *
+ * Starts GAME (default ./tetris) on a pseudo-terminal, types KEYS over and
+ * over at RATE keys per second and follows the ANSI stream coming back in a
+ * shadow copy of both playfields. An input counts as answered by the first
+ * change to its player's cells that gravity alone can't explain: a change
+ * that leaves every column's filled-cell count as it was is the piece
+ * falling and answers nothing. Inputs that change nothing (a move against a
+ * wall, rotating an O) are reported as unanswered when the player's next key
+ * is sent, or after a second. So are inputs the game folds into one frame
+ * with the next key, which only happens at rates far above the default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <sys/wait.h>
+
+// Must match the layout in tetris.c.
+#define PLAYFIELD_W 10
+#define PLAYFIELD_H 20
+#define PLAYFIELD_X 30
+#define PLAYFIELD_XX 120
+#define PLAYFIELD_Y 1
+
+#define ANSWER_TIMEOUT 1000000000L // ns
+
+typedef struct {
+    int state; // 0: text, 1: after ESC, 2: inside CSI
+    int params[2];
+    int param_count;
+    int x; // cursor, 1-based like CUP
+    int y;
+    char cells[2][PLAYFIELD_H][PLAYFIELD_W]; // 1: filled, as last printed
+    int border_done; // last character of player 2's bottom border printed
+} ansi_parser_s;
+
+long now_ns() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+int key_player(char key) {
+    switch (key) {
+        case 'g':
+        case 'd':
+        case 'r':
+        case 'f':
+        case 'a':
+            return 0;
+        case '6':
+        case '4':
+        case '8':
+        case '5':
+        case 'p':
+            return 1;
+        default:
+            return -1;
+    }
+}
+
+int cell_player(int x, int y) { // which playfield a cursor position falls into, -1 for neither
+    if (y < PLAYFIELD_Y || y >= PLAYFIELD_Y + PLAYFIELD_H) {
+        return -1;
+    }
+    if (x >= PLAYFIELD_X && x < PLAYFIELD_X + PLAYFIELD_W * 2) {
+        return 0;
+    }
+    if (x >= PLAYFIELD_XX && x < PLAYFIELD_XX + PLAYFIELD_W * 2) {
+        return 1;
+    }
+    return -1;
+}
+
+// Feeds one output byte; cells are printed as "[]" (filled) or " ." (empty).
+void ansi_feed(ansi_parser_s *parser, unsigned char c) {
+    int player = 0;
+    int x = 0;
+
+    switch (parser->state) {
+        case 0:
+            if (c == 27) {
+                parser->state = 1;
+                return;
+            }
+            player = cell_player(parser->x, parser->y);
+            x = parser->x - (player == 0 ? PLAYFIELD_X : PLAYFIELD_XX);
+            if (player >= 0 && x % 2 == 0) {
+                parser->cells[player][parser->y - PLAYFIELD_Y][x / 2] = (c == '[');
+            }
+            if (parser->y == PLAYFIELD_Y + PLAYFIELD_H + 1 && parser->x == PLAYFIELD_XX + PLAYFIELD_W * 2 - 1) {
+                parser->border_done = 1;
+            }
+            parser->x++;
+            return;
+        case 1:
+            parser->state = (c == '[') ? 2 : 0;
+            parser->params[0] = 0;
+            parser->params[1] = 0;
+            parser->param_count = 0;
+            return;
+        default:
+            if (c >= '0' && c <= '9') {
+                if (parser->param_count < 2) {
+                    parser->params[parser->param_count] = parser->params[parser->param_count] * 10 + (c - '0');
+                }
+            } else if (c == ';') {
+                parser->param_count++;
+            } else if (c >= 0x40) { // final byte; '?', '$' and friends keep the sequence going
+                parser->state = 0;
+                if (c == 'H') {
+                    parser->y = parser->params[0] ? parser->params[0] : 1;
+                    parser->x = parser->params[1] ? parser->params[1] : 1;
+                }
+            }
+            return;
+    }
+}
+
+int filled_cells(char cells[PLAYFIELD_H][PLAYFIELD_W]) {
+    int count = 0;
+    int x = 0;
+    int y = 0;
+
+    for (y = 0; y < PLAYFIELD_H; y++) {
+        for (x = 0; x < PLAYFIELD_W; x++) {
+            count += cells[y][x];
+        }
+    }
+    return count;
+}
+
+// Whether the cells changed in a way that falling alone can't produce.
+int board_answers(char before[PLAYFIELD_H][PLAYFIELD_W], char after[PLAYFIELD_H][PLAYFIELD_W]) {
+    int column = 0;
+    int x = 0;
+    int y = 0;
+
+    for (x = 0; x < PLAYFIELD_W; x++) {
+        column = 0;
+        for (y = 0; y < PLAYFIELD_H; y++) {
+            column += after[y][x] - before[y][x];
+        }
+        if (column != 0) {
+            return 1;
+        }
+    }
+    return 0; // unchanged, or the piece fell a row
+}
+
+int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+
+    return (x > y) - (x < y);
+}
+
+double percentile(long *values, long count, double p) {
+    long i = (long)(p * count);
+
+    if (count == 0) {
+        return 0;
+    }
+    return values[i < count ? i : count - 1] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    double rate = 50;
+    long inputs = 2000;
+    const char *keys = "gd46r8";
+    const char *game = "./tetris";
+    struct winsize ws = { 40, 160, 0, 0 };
+    long pending[2] = {}; // send time of each player's unanswered input, 0 for none
+    ansi_parser_s parser = {};
+    char shown[2][PLAYFIELD_H][PLAYFIELD_W]; // cells when last checked
+    unsigned char buf[65536];
+    long *latencies = NULL;
+    long answered = 0;
+    long unanswered = 0;
+    long sent = 0;
+    long bytes = 0;
+    long next_send = 0;
+    long start = 0;
+    long now = 0;
+    long give_up = 0;
+    struct pollfd pfd;
+    ssize_t n = 0;
+    pid_t pid = 0;
+    int fd = -1;
+    int opt = 0;
+    int player = 0;
+    int timeout = 0;
+    int i = 0;
+    char key = 0;
+
+    while ((opt = getopt(argc, argv, "r:n:k:")) != -1) {
+        switch (opt) {
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'n':
+                inputs = atol(optarg);
+                break;
+            case 'k':
+                keys = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-r RATE] [-n INPUTS] [-k KEYS] [GAME]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        game = argv[optind];
+    }
+    if (rate <= 0 || inputs < 1 || !*keys) {
+        fprintf(stderr, "rate, inputs and keys must be positive/non-empty\n");
+        return 1;
+    }
+    latencies = malloc(inputs * sizeof(long));
+
+    pid = forkpty(&fd, NULL, NULL, &ws);
+    if (pid < 0) {
+        perror("forkpty");
+        return 1;
+    }
+    if (pid == 0) {
+        execl(game, game, (char *)NULL);
+        perror(game);
+        _exit(127);
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    // Let the first full screen go by before measuring: both borders drawn, then both pieces.
+    give_up = now_ns() + 5000000000L; // the game probes the terminal for up to 300 ms first
+    while (!parser.border_done || filled_cells(parser.cells[0]) < 4 || filled_cells(parser.cells[1]) < 4) {
+        if (now_ns() > give_up) {
+            fprintf(stderr, "%s never drew a full screen\n", game);
+            return 1;
+        }
+        if (poll(&pfd, 1, 50) > 0) {
+            n = read(fd, buf, sizeof(buf));
+            if (n <= 0) {
+                fprintf(stderr, "%s exited before drawing\n", game);
+                return 1;
+            }
+            for (i = 0; i < n; i++) {
+                ansi_feed(&parser, buf[i]);
+            }
+        }
+    }
+
+    memcpy(shown, parser.cells, sizeof(shown));
+    start = now_ns();
+    next_send = start;
+    while (sent < inputs || pending[0] || pending[1]) {
+        now = now_ns();
+        if (sent < inputs && now >= next_send) {
+            key = keys[sent % strlen(keys)];
+            player = key_player(key);
+            if (write(fd, &key, 1) == 1) {
+                if (player >= 0) {
+                    if (pending[player]) { // the previous input changed nothing visible
+                        unanswered++;
+                    }
+                    pending[player] = now;
+                }
+                sent++;
+            }
+            next_send = start + (long)(sent * 1e9 / rate);
+        }
+        for (player = 0; player < 2; player++) {
+            if (pending[player] && now - pending[player] > ANSWER_TIMEOUT) {
+                pending[player] = 0;
+                unanswered++;
+            }
+        }
+
+        timeout = sent < inputs ? (int)((next_send - now_ns()) / 1000000) : 50;
+        if (poll(&pfd, 1, timeout > 0 ? timeout : 0) <= 0) {
+            continue;
+        }
+        n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            fprintf(stderr, "game exited after %ld inputs\n", sent);
+            break;
+        }
+        now = now_ns();
+        bytes += n;
+        for (i = 0; i < n; i++) {
+            ansi_feed(&parser, buf[i]);
+        }
+        for (player = 0; player < 2; player++) {
+            if (pending[player] && board_answers(shown[player], parser.cells[player])) {
+                latencies[answered++] = now - pending[player];
+                pending[player] = 0;
+            }
+        }
+        memcpy(shown, parser.cells, sizeof(shown));
+    }
+
+    if (write(fd, "q", 1) == 1) {
+        usleep(200000);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    qsort(latencies, answered, sizeof(long), compare_long);
+    printf("inputs sent:        %ld at %.0f/s\n", sent, rate);
+    printf("answered:           %ld (%ld unanswered)\n", answered, unanswered);
+    printf("latency p50:        %.1f us\n", percentile(latencies, answered, 0.50));
+    printf("latency p99:        %.1f us\n", percentile(latencies, answered, 0.99));
+    printf("latency p999:       %.1f us\n", percentile(latencies, answered, 0.999));
+    printf("output bytes/input: %.1f\n", sent ? (double)bytes / sent : 0);
+    free(latencies);
+    return 0;
+}